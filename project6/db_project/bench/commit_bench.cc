@@ -0,0 +1,78 @@
+// Commit throughput benchmark
+// Each thread runs short transactions updating one record of its own
+// usage: commit_bench [max_threads] [seconds]
+
+#include "mybpt.h"
+#include "trx.h"
+#include "recovery.h"
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace
+{
+    constexpr int KEYS_PER_THREAD = 100;
+    constexpr uint16_t VALUE_SIZE = 60;
+
+    std::atomic<bool> running;
+    std::atomic<long> commits;
+
+    void worker(int64_t table_id, int thread_no)
+    {
+        char value[VALUE_SIZE];
+        std::memset(value, 'a' + thread_no % 26, sizeof(value));
+        uint16_t old_val_size;
+        long done = 0;
+        for (int i = 0; running; i++)
+        {
+            int trx_id = trx_begin();
+            int64_t key = thread_no * KEYS_PER_THREAD + i % KEYS_PER_THREAD + 1;
+            if (db_update(table_id, key, value, VALUE_SIZE, &old_val_size, trx_id) == 0)
+            {
+                trx_commit(trx_id);
+                done++;
+            }
+        }
+        commits += done;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int max_threads = argc > 1 ? std::atoi(argv[1]) : 16;
+    double seconds = argc > 2 ? std::atof(argv[2]) : 2.0;
+
+    std::remove("DATA950");
+    log_remove((char*)"commit_bench_log");
+    init_db(1000, 0, 0, (char*)"commit_bench_log", (char*)"commit_bench_logmsg");
+    int64_t table_id = open_table((char*)"DATA950");
+
+    char value[VALUE_SIZE];
+    std::memset(value, '0', sizeof(value));
+    for (int64_t key = 1; key <= (int64_t)max_threads * KEYS_PER_THREAD; key++)
+    {
+        db_insert(table_id, key, value, VALUE_SIZE);
+    }
+
+    for (int threads = 1; threads <= max_threads; threads *= 2)
+    {
+        running = true;
+        commits = 0;
+        std::vector<std::thread> workers;
+        for (int i = 0; i < threads; i++) workers.emplace_back(worker, table_id, i);
+        std::this_thread::sleep_for(std::chrono::duration<double>(seconds));
+        running = false;
+        for (auto& t : workers) t.join();
+
+        std::printf("threads=%d commits=%ld commits_per_s=%.0f\n", threads, commits.load(), commits / seconds);
+    }
+
+    shutdown_db();
+    return 0;
+}
@@ -0,0 +1,97 @@
+// Page size benchmark
+// Built once per page size (db_4096 ... db_32768), see bench/run.sh
+// usage: page_size_bench [num_records] [buffer_bytes]
+
+#include "mybpt.h"
+#include "file.h"
+#include "page.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <string>
+#include <vector>
+
+namespace
+{
+    double seconds_since(std::chrono::steady_clock::time_point start)
+    {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Number of levels from the root to the leaves, read from the file
+    int tree_height(int64_t fd)
+    {
+        page_t page;
+        file_read_page(fd, 0, &page);
+        pagenum_t pagenum = PageIO::HeaderPage::get_root_pagenum(&page);
+        if (pagenum == 0) return 0;
+
+        int height = 1;
+        file_read_page(fd, pagenum, &page);
+        while (!PageIO::BPT::get_is_leaf(&page))
+        {
+            pagenum = PageIO::BPT::InternalPage::get_leftmost_pagenum(&page);
+            file_read_page(fd, pagenum, &page);
+            height++;
+        }
+        return height;
+    }
+}
+
+int main(int argc, char** argv)
+{
+    int num_records = argc > 1 ? std::atoi(argv[1]) : 100000;
+    uint64_t buffer_bytes = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 16ULL << 20;
+
+    // Same memory budget for every page size
+    int num_buf = buffer_bytes / PAGE_SIZE;
+
+    std::string pathname = "DATA" + std::to_string(PAGE_SIZE / 1024 + 900);
+    std::remove(pathname.c_str());
+
+    std::vector<int64_t> keys(num_records);
+    for (int i = 0; i < num_records; i++) keys[i] = i + 1;
+    std::mt19937_64 rng(20211215);
+    std::shuffle(keys.begin(), keys.end(), rng);
+
+    char value[MAX_VAL_SIZE];
+    std::memset(value, 'v', sizeof(value));
+
+    init_db(num_buf);
+    int64_t table_id = open_table(const_cast<char*>(pathname.c_str()));
+
+    auto start = std::chrono::steady_clock::now();
+    for (int64_t key : keys)
+    {
+        db_insert(table_id, key, value, 50 + key % 60);
+    }
+    double insert_time = seconds_since(start);
+
+    std::shuffle(keys.begin(), keys.end(), rng);
+    char ret_val[MAX_VAL_SIZE];
+    uint16_t val_size;
+    int found = 0;
+    start = std::chrono::steady_clock::now();
+    for (int64_t key : keys)
+    {
+        found += db_find(table_id, key, ret_val, &val_size) == 0;
+    }
+    double find_time = seconds_since(start);
+
+    shutdown_db();
+
+    int64_t fd = file_open_table_file(pathname.c_str());
+    page_t header;
+    file_read_page(fd, 0, &header);
+    pagenum_t used_pages = PageIO::HeaderPage::get_high_water_mark(&header);
+    int height = tree_height(fd);
+    file_close_database_file();
+
+    std::printf("page_size=%lu records=%d found=%d height=%d pages=%lu bytes=%lu insert_s=%.3f find_s=%.3f find_per_s=%.0f\n",
+        PAGE_SIZE, num_records, found, height, used_pages, used_pages * PAGE_SIZE,
+        insert_time, find_time, num_records / find_time);
+    return 0;
+}
@@ -0,0 +1,9 @@
+# usage: bench/run.sh [num_records] [buffer_bytes]
+cmake -S . -B build -DUSE_BENCHMARK=ON
+cmake --build build
+cd build/bin
+for size in 4096 8192 16384 32768
+do
+    ./page_size_bench_$size "$@" | grep page_size
+done
+cd ../..
@@ -6,35 +6,95 @@
 #include <vector>
 #include <map>
 #include <unordered_map>
+#include <atomic>
 
 extern std::unordered_map<int64_t, int64_t> table_id_map;
 
+// Location of a table's root pagenum inside its tablespace catalog
+struct catalog_ref_t {
+    pagenum_t catalog_pagenum;
+    int slot;
+};
+
+extern std::unordered_map<int64_t, catalog_ref_t> catalog_map;
+
+constexpr uint64_t LSN_NONE = UINT64_MAX;
+// Root or leaf pagenum when a page on the way failed its checksum
+constexpr pagenum_t PAGENUM_CORRUPTED = UINT64_MAX;
+
 // TODO: Encapsulate This Structure (Probably after finish implementing everything)
 struct control_block_t {
     page_t* frame;
     int64_t table_id;
     pagenum_t pagenum;
     int is_dirty;
+    int64_t tid;                   // table id the page was read for, table_id is the file
+    std::atomic<uint64_t> rec_lsn; // log end when the page got dirty, LSN_NONE if clean
+    std::atomic<uint64_t> fix_lsn; // log end when the page was latched, LSN_NONE if not
+    std::atomic<bool> tracked;     // latched or changed by an open structure modification, kept on the buffer
+    std::atomic<bool> checksum;    // stamped on write back, from the table's setting
+    bool corrupted;                // failed its checksum, holds the bytes as read
     pthread_mutex_t page_latch;
     control_block_t* next;
     control_block_t* prev;
 };
 
+// Page checksum counters, summed over all tables
+struct buf_checksum_stats_t {
+    uint64_t stamped;
+    uint64_t verified;
+    uint64_t failures;
+};
+
+// Dirty page table entry, written by checkpoints
+struct dpt_entry_t {
+    int64_t table_id;
+    pagenum_t pagenum;
+    uint64_t rec_lsn;
+};
+
+// Page changed while its thread tracks pages, with its image from before
+struct tracked_page_t {
+    control_block_t* ctrl_block;
+    int64_t tid;
+    page_t before;
+    bool changed;
+};
+
 // Helper Functions
+void write_back_frame(control_block_t* cur);
+bool read_into_frame(control_block_t* cur, int64_t table_id, pagenum_t page_number);
 void move_to_beg_of_list(control_block_t* cur);
 control_block_t* find_buffer(int64_t table_id, pagenum_t page_number);
 control_block_t* find_victim();
 control_block_t* add_new_page(int64_t table_id, pagenum_t page_number);
-void free_page(int64_t table_id, pagenum_t page_number);
 
 // APIs
-int64_t buf_open_table_file(const char* pathname, int64_t tid);
+int64_t buf_open_table_file(const char* pathname, int64_t tid, bool compressed = false);
+int64_t buf_open_tablespace_file(const char* pathname);
+int64_t buf_open_table_in_tablespace(int64_t tablespace_id, int64_t tid);
+bool buf_is_table_open(int64_t tid);
+pagenum_t buf_get_root_pagenum(int64_t table_id);
+void buf_set_root_pagenum(int64_t table_id, pagenum_t root_pagenum);
 void buf_return_ctrl_block(control_block_t** ctrl_block, int is_dirty = 0);
+void buf_mark_dirty(control_block_t* ctrl_block, uint64_t rec_lsn);
+void buf_flush_old_pages(uint64_t rec_lsn);
+std::vector<dpt_entry_t> buf_get_dirty_pages();
 control_block_t* buf_read_page(int64_t table_id, pagenum_t page_number);
+void buf_prefetch_page(int64_t table_id, pagenum_t page_number);
 pagenum_t buf_alloc_page(int64_t table_id);
+void buf_set_checksum(int64_t table_id, bool enabled);
+buf_checksum_stats_t buf_get_checksum_stats();
 void buf_free_page(int64_t table_id, pagenum_t page_number);
 
+// Pages the calling thread latches or changes from buf_track_begin on stay
+// on the buffer and are not written back until buf_track_end, so a structure
+// modification can be logged as a whole before any of it reaches disk.
+void buf_track_begin();
+std::vector<tracked_page_t>& buf_tracked_pages();
+void buf_track_end();
+
 int buf_init_db(int num_buf);
 int buf_shutdown_db();
 
-#endif //__BUFFER_H__
\ No newline at end of file
+#endif //__BUFFER_H__
\ No newline at end of file
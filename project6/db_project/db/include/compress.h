@@ -0,0 +1,59 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+
+#include "page.h"
+#include <cstdint>
+#include <pthread.h>
+#include <utility>
+#include <vector>
+
+constexpr char COMPRESS_MAGIC[8] = { 'D', 'B', 'C', 'P', 'A', 'G', 'E', '1' };
+constexpr uint64_t COMPRESS_UNIT = 512; // extents are multiples of this
+constexpr uint64_t COMPRESS_MAX_UNITS = PAGE_SIZE / COMPRESS_UNIT;
+constexpr uint64_t COMPRESS_MAP_ENTRY_SIZE = 16;
+constexpr size_t COMPRESS_PENDING_FREE = 64; // moved pages' extents held before a sync
+
+constexpr uint16_t CODEC_RAW = 0;
+constexpr uint16_t CODEC_LZ = 1;
+
+// Where a page lives in the compressed file, length 0 if never written
+struct extent_t {
+    uint64_t offset;
+    uint32_t length;
+    uint16_t units;
+    uint16_t codec;
+};
+
+struct compressed_file_t {
+    int map_fd;
+    uint64_t end;
+    std::vector<extent_t> map;
+    std::vector<std::vector<uint64_t>> free_extents; // indexed by units
+    std::vector<std::pair<uint64_t, uint16_t>> pending_free; // offset, units
+    pthread_mutex_t latch;
+};
+
+struct compress_stats_t {
+    uint64_t logical_bytes;  // page bytes written through the compressed store
+    uint64_t physical_bytes; // bytes that actually reached the files
+};
+
+namespace Compress
+{
+    // Built-in LZ77 codec, LZ4-like block format
+    // Returns compressed size, or 0 if it does not fit in dst_capacity
+    int compress(const char* src, int src_size, char* dst, int dst_capacity);
+    // Returns decompressed size, or -1 if src is malformed
+    int decompress(const char* src, int src_size, char* dst, int dst_capacity);
+
+    bool probe(int fd);
+    bool is_compressed(int64_t fd);
+    int create(int fd, const char* pathname);
+    int attach(int fd, const char* pathname);
+    bool read_page(int fd, pagenum_t page_number, char* dest);
+    bool write_page(int fd, pagenum_t page_number, const char* src);
+    void detach_all();
+    compress_stats_t get_stats();
+}
+
+#endif // __COMPRESS_H__
@@ -0,0 +1,41 @@
+#ifndef __DEADLOCK_H__
+#define __DEADLOCK_H__
+
+#include <pthread.h>
+#include <unordered_map>
+#include <vector>
+
+// Deadlock handling, chosen at trx_init. Smaller trx_id is older.
+constexpr int DEADLOCK_DETECT = 0;     // wait-for graph, cheapest trx on a cycle aborts
+constexpr int DEADLOCK_WAIT_DIE = 1;   // older waits for younger, younger dies
+constexpr int DEADLOCK_WOUND_WAIT = 2; // older aborts younger, younger waits
+
+// Wait-for graph. Only blocked transactions have out edges, and they are
+// set when the transaction blocks and dropped when it stops waiting, so a
+// cycle can only appear when some transaction blocks. Checking from that
+// transaction alone is enough to find every deadlock.
+struct wait_for_node_t {
+    std::vector<int> waits_for;
+    size_t cost; // work thrown away if the transaction aborts
+};
+
+struct wait_for_graph_t {
+    std::unordered_map<int, wait_for_node_t> nodes;
+    pthread_mutex_t latch;
+};
+
+namespace WaitForGraph
+{
+    int init();
+    int shutdown();
+
+    // Replace the out edges of a blocked transaction
+    void set_waits(int trx_id, const std::vector<int>& holders, size_t cost);
+    void clear(int trx_id);
+    // Transactions on a cycle through trx_id, empty if there is none
+    std::vector<int> find_cycle(int trx_id);
+    // Cheapest transaction on the cycle, the youngest one on ties
+    int choose_victim(const std::vector<int>& cycle);
+}
+
+#endif // __DEADLOCK_H__
@@ -1,6 +1,7 @@
 #ifndef __FILE_H__
 #define __FILE_H__
 #include <cstdint>
+#include <cerrno>
 #include <fcntl.h>
 #include <unistd.h>
 #include <cstring>
@@ -14,29 +15,48 @@ namespace FileIO
     extern std::vector<int> opened_files;
     int open(const char* filename);
     off_t size(int fd);
-    void write(int fd, const void* src, int n, int offset);
-    void read(int fd, void* dst, int n, int offset);
+    bool write(int fd, const void* src, int n, off_t offset);
+    bool read(int fd, void* dst, int n, off_t offset);
+    void allocate(int fd, off_t size);
+    void prefetch(int fd, int n, off_t offset);
+    void sync(int fd);
     void close(int fd);
 }
 
 
 // Read an on-disk page into the in-memory page structure(dest)
-void file_read_page(int64_t table_id, pagenum_t page_number, page_t* dest);
+// Returns false if the page could not be read
+bool file_read_page(int64_t table_id, pagenum_t page_number, page_t* dest);
 
 // Write an in-memory page(src) to the on-disk page
 void file_write_page(int64_t table_id, pagenum_t page_number, const page_t* src);
 
+// Start reading an on-disk page in the background, a later read finds it cached
+void file_prefetch_page(int64_t table_id, pagenum_t page_number);
+
+// Whether the file was created with the page size of this build
+bool file_check_page_size(int64_t table_id, const char* pathname);
+
 // Open existing database file or create one if not existed.
 int64_t file_open_table_file(const char* pathname);
 
+// Open existing database file or create a compressed one if not existed.
+int64_t file_open_compressed_table_file(const char* pathname);
+
+// Open existing tablespace file or create one if not existed.
+int64_t file_open_tablespace_file(const char* pathname);
+
 // Allocate an on-disk page from the free page list
 pagenum_t file_alloc_page(int64_t table_id);
 
+// Allocate a page using the given header page image
+pagenum_t file_alloc_from_header(int64_t table_id, page_t* header_page);
+
 // Free an on-disk page to the free page list
 void file_free_page(int64_t table_id, pagenum_t page_number);
 
 // Read an on-disk page into the in-memory page structure(dest)
-void file_read_page(int64_t table_id, pagenum_t page_number, char* dest);
+bool file_read_page(int64_t table_id, pagenum_t page_number, char* dest);
 
 // Write an in-memory page(src) to the on-disk page
 void file_write_page(int64_t table_id, pagenum_t page_number, const char* src);
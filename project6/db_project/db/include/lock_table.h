@@ -3,16 +3,23 @@
 
 #include "page.h"
 #include <stdint.h>
+#include <atomic>
+#include <bitset>
 #include <unordered_map>
+#include <vector>
 #include <pthread.h>
 #include <iostream>
 
 #define LOCK_MODE_EXCLUSIVE 1
 #define LOCK_MODE_SHARED 0
 
+// One bit per record slot of a leaf page
+typedef std::bitset<LEAF_MAX_SLOTS> record_bitmap_t;
+
 struct lock_t;
 struct Hash;
 struct hash_table_entry_t;
+struct lock_table_partition_t;
 
 struct lock_t{
 	lock_t* next;
@@ -26,7 +33,7 @@ struct lock_t{
 	lock_t* wait_for;
 	char* original_value;
 	int original_size;
-	uint64_t bitmap; // maximum of 62 records in a page so uint64_t is enough
+	record_bitmap_t bitmap;
 };
 
 struct Hash{
@@ -35,11 +42,54 @@ struct Hash{
 	}
 };
 
+// Fast path for shared locks on pages without conflicting requests:
+// a transaction claims one of the entry's fast slots with a CAS and sets
+// record bits in it, without taking any latch. The first explicit lock
+// queued on the page sets FAST_HEADER_SLOW and converts every claimed slot
+// into an explicit S lock, so the queue sees all holders from then on.
+constexpr int FAST_SLOTS = 8;
+constexpr int FAST_BITMAP_WORDS = (LEAF_MAX_SLOTS + 63) / 64;
+constexpr uint64_t FAST_HEADER_SLOW = 1; // header is generation << 1 | slow
+constexpr uint64_t FAST_SLOT_CONVERTED = 1ULL << 63; // slot is trx_id | converted
+
 struct hash_table_entry_t{
 	int64_t table_id;
 	int64_t page_id;
 	lock_t* tail;
 	lock_t* head;
+	lock_table_partition_t* partition;
+	hash_table_entry_t* hash_next;
+	std::atomic<uint64_t> fast_header;
+	std::atomic<uint64_t> fast_owner[FAST_SLOTS];
+	std::atomic<uint64_t> fast_bits[FAST_SLOTS][FAST_BITMAP_WORDS];
+	lock_t* fast_lock[FAST_SLOTS]; // explicit lock a converted slot became
+};
+
+// A fast slot held by a transaction
+struct fast_lock_ref_t{
+	hash_table_entry_t* entry;
+	int slot;
+};
+
+// The lock table is split by hash of (table_id, page_id) into partitions,
+// each with its own latch, so that locks on different pages don't contend
+constexpr int LOCK_TABLE_PARTITIONS = 64;
+constexpr int LOCK_TABLE_BUCKETS = 256; // per partition
+constexpr int LOCK_SLAB_SIZE = 64;
+
+// Lock objects and hash entries come from per-partition slabs and are
+// recycled through free lists, so steady state acquire/release does not
+// allocate. Condition variables are initialized once per slab.
+// Entries stay in the hash while idle so the fast path can find them, and
+// are reclaimed when the partition runs out of free entries. Slabs are
+// only freed at shutdown, which makes latch-free lookups safe.
+struct lock_table_partition_t{
+	pthread_mutex_t latch;
+	hash_table_entry_t* buckets[LOCK_TABLE_BUCKETS];
+	lock_t* free_locks;
+	hash_table_entry_t* free_entries;
+	std::vector<lock_t*> lock_slabs;
+	std::vector<hash_table_entry_t*> entry_slabs;
 };
 
 typedef struct lock_t lock_t;
@@ -48,6 +98,13 @@ typedef struct hash_table_entry_t hash_table_entry_t;
 
 // Helper Function
 void wake_up(hash_table_entry_t* list, lock_t* lock);
+lock_table_partition_t* get_partition(int64_t table_id, int64_t page_id);
+pthread_mutex_t* get_entry_latch(hash_table_entry_t* list);
+hash_table_entry_t* find_entry(lock_table_partition_t* partition, int64_t table_id, int64_t page_id);
+hash_table_entry_t* alloc_entry(lock_table_partition_t* partition, int64_t table_id, int64_t page_id);
+void free_entry(hash_table_entry_t* list);
+lock_t* alloc_lock(lock_table_partition_t* partition);
+void free_lock(lock_table_partition_t* partition, lock_t* lock);
 
 /* APIs for lock table */
 int init_lock_table();
@@ -55,8 +112,10 @@ lock_t* lock_acquire_compressed(int64_t table_id, pagenum_t page_id, int64_t key
 int shutdown_lock_table();
 lock_t *lock_acquire(int64_t table_id, pagenum_t page_id, int64_t key, int trx_id, int lock_mode);
 int lock_release(lock_t* lock_obj);
-bool lock_exist(int64_t table_id, int64_t page_id, int64_t key, int trx_id);
+bool lock_exist(int64_t table_id, int64_t page_id, int64_t key);
+bool lock_acquire_fast(int64_t table_id, pagenum_t page_id, int64_t key, int trx_id, std::vector<fast_lock_ref_t>& fast_locks);
+void lock_release_fast(const fast_lock_ref_t& ref, int trx_id);
 
-extern std::unordered_map<std::pair<int64_t, int64_t>, hash_table_entry_t*, Hash> lock_table;
+extern lock_table_partition_t lock_table[LOCK_TABLE_PARTITIONS];
 
 #endif /* __LOCK_TABLE_H__ */
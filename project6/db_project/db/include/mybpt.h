@@ -4,13 +4,14 @@
 #include "page.h"
 #include "file.h"
 #include "buffer.h"
+#include "deadlock.h"
 #include <regex>
 #include <set>
 
 
 constexpr uint64_t NODE_MAX_KEYS = (PAGE_SIZE - PH_SIZE) / BRANCH_FACTOR_SIZE;
 constexpr uint16_t MAX_VAL_SIZE = 112;
-constexpr uint64_t THRESHHOLD = 2500;
+constexpr uint64_t THRESHHOLD = PAGE_SIZE * 2500 / 4096; // 2500 bytes of a 4 KiB page
 
 // Functions
 
@@ -51,7 +52,7 @@ int64_t open_table(char* pathname);
 int db_insert(int64_t table_id, int64_t key, char* value, uint16_t val_size);
 int db_find(int64_t table_id, int64_t key, char* ret_val, uint16_t* val_size);
 int db_delete(int64_t table_id, int64_t key);
-int init_db(int num_buf);
+int init_db(int num_buf, int deadlock_policy = DEADLOCK_DETECT);
 int shutdown_db();
 
 void db_print_tree(int64_t table_id);
@@ -65,7 +66,14 @@ int db_find(int64_t table_id, int64_t key, char* ret_val, uint16_t* val_size, in
 int db_update(int64_t table_id, int64_t key, char* value, uint16_t val_size, uint16_t* old_val_size, int trx_id);
 
 // Newly Added API from Project 6
-int init_db(int num_buf, int flag, int log_num, char* log_path, char* logmsg_path);
+int init_db(int num_buf, int flag, int log_num, char* log_path, char* logmsg_path, int deadlock_policy = DEADLOCK_DETECT);
+
+// Tablespace: several tables sharing one file
+int64_t open_tablespace(char* pathname);
+int64_t open_table_in_tablespace(int64_t tablespace_id, char* pathname);
+
+// Compressed table: pages are stored compressed on disk
+int64_t open_table(char* pathname, bool compressed);
 void analysis();
 void redo();
 void undo();
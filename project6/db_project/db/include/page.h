@@ -9,16 +9,29 @@
 
 typedef uint64_t pagenum_t;
 
+// Page size is fixed at compile time (cmake -DDB_PAGE_SIZE=16384)
+// and recorded in the header page of every table file.
+#ifndef DB_PAGE_SIZE
+#define DB_PAGE_SIZE 4096
+#endif
+
 constexpr uint64_t INITIAL_SIZE = 10485760; // 10 MiB
-constexpr uint64_t PAGE_SIZE = 4096;
+constexpr uint64_t PAGE_SIZE = DB_PAGE_SIZE;
+constexpr uint64_t LEGACY_PAGE_SIZE = 4096; // files without a recorded page size
+static_assert(PAGE_SIZE == 4096 || PAGE_SIZE == 8192 || PAGE_SIZE == 16384 || PAGE_SIZE == 32768,
+    "DB_PAGE_SIZE must be 4096, 8192, 16384 or 32768"); // in-page offsets are uint16_t
 constexpr uint64_t SLOT_SIZE = 16;
 constexpr uint64_t BRANCH_FACTOR_SIZE = 16;
 constexpr pagenum_t INITIAL_FREE_PAGES = (INITIAL_SIZE / PAGE_SIZE) - 1;
 constexpr uint64_t INITIAL_FREE_SPACE = PAGE_SIZE - 128;
+constexpr uint64_t LEAF_MAX_SLOTS = INITIAL_FREE_SPACE / SLOT_SIZE;
 
 constexpr uint64_t HEADER_FREE_OFFSET = 0;
 constexpr uint64_t HEADER_NUMPAGE_OFFSET = 8;
 constexpr uint64_t HEADER_ROOT_PAGENUM_OFFSET = 16;
+constexpr uint64_t HEADER_CATALOG_PAGENUM_OFFSET = 32;
+constexpr uint64_t HEADER_HIGH_WATER_MARK_OFFSET = 40;
+constexpr uint64_t HEADER_PAGE_SIZE_OFFSET = 48;
 constexpr uint64_t FREE_FREE_OFFSET = 0;
 constexpr uint64_t LEAF_AMOUNT_FREE_SPACE_OFFSET = 112;
 constexpr uint64_t LEAF_RIGHT_SIB_PNUM_OFFSET = 120;
@@ -36,11 +49,20 @@ constexpr uint64_t PH_PARENT_PAGENUM_OFFSET = 0;
 constexpr uint64_t PH_IS_LEAF_OFFSET = 8;
 constexpr uint64_t PH_NUM_KEYS_OFFSET = 12;
 constexpr uint64_t PH_PAGE_LSN_OFFSET = 24;
+constexpr uint64_t PAGE_CHECKSUM_OFFSET = 104; // unused by every page type, 0 if not stamped
 constexpr uint64_t PH_SIZE = 128;
 
 constexpr uint64_t INTERNAL_LFT_PAGENUM_OFFSET = 120;
 constexpr uint64_t INTERNAL_BRANCH_FACTOR_OFFSET = 128;
 
+// Catalog page of a tablespace: (table_id, root_pagenum) per B+ tree
+constexpr uint64_t CATALOG_NUM_ENTRIES_OFFSET = 12;
+constexpr uint64_t CATALOG_ENTRY_OFFSET = 128;
+constexpr uint64_t CATALOG_ENTRY_SIZE = 16;
+constexpr uint64_t CATALOG_ENTRY_TABLE_ID_OFFSET = 0;
+constexpr uint64_t CATALOG_ENTRY_ROOT_PAGENUM_OFFSET = 8;
+constexpr uint64_t CATALOG_MAX_ENTRIES = (PAGE_SIZE - CATALOG_ENTRY_OFFSET) / CATALOG_ENTRY_SIZE;
+
 
 
 class page_t
@@ -87,14 +109,38 @@ public:
     void set_pagenum(pagenum_t pagenum);
 };
 
+// CRC32C (Castagnoli), uses SSE4.2 crc32 instruction when available
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len);
+
 namespace PageIO {
+    namespace Checksum {
+        uint32_t compute(page_t* page);
+        uint32_t get(page_t* page);
+        void set(page_t* page, uint32_t checksum);
+        void stamp(page_t* page);
+        bool verify(page_t* page);
+    }
     namespace HeaderPage {
         pagenum_t get_free_pagenum(page_t* page);
         uint64_t get_num_pages(page_t* page);
         pagenum_t get_root_pagenum(page_t* page);
+        pagenum_t get_catalog_pagenum(page_t* page);
+        pagenum_t get_high_water_mark(page_t* page);
+        uint64_t get_page_size(page_t* page);
         void set_free_pagenum(page_t* page, pagenum_t free_pagenum);
         void set_num_pages(page_t* page, uint64_t num_pages);
         void set_root_pagenum(page_t* page, pagenum_t root_pagenum);
+        void set_catalog_pagenum(page_t* page, pagenum_t catalog_pagenum);
+        void set_high_water_mark(page_t* page, pagenum_t high_water_mark);
+        void set_page_size(page_t* page, uint64_t page_size);
+    }
+    namespace CatalogPage {
+        int get_num_entries(page_t* page);
+        int64_t get_nth_table_id(page_t* page, int n);
+        pagenum_t get_nth_root_pagenum(page_t* page, int n);
+        void set_num_entries(page_t* page, int num_entries);
+        void set_nth_table_id(page_t* page, int n, int64_t table_id);
+        void set_nth_root_pagenum(page_t* page, int n, pagenum_t root_pagenum);
     }
     namespace FreePage {
         pagenum_t get_next_free_pagenum(page_t* page);
@@ -11,17 +11,66 @@
 #define LOG_COMMIT 2
 #define LOG_ROLLBACK 3
 #define LOG_COMPENSATE 4
-#define LOG_BUFFER_SIZE 64
+#define LOG_CHECKPOINT 5
+#define LOG_SMO 6 // redo-only, new bytes of the pages a structure modification changed
+#define LOG_COMPACT 0x10 // type bit of an update or CLR in the compact format
+
+// recover_main flag: open for new transactions after redo, losers keep
+// their records locked and are rolled back in the background
+#define RECOVER_INSTANT 3
 
 constexpr int LOG_ENTRY_SIZE = 28;
 constexpr int LOG_ENTRY_EXT_SIZE = 48;
+constexpr int LOG_ENTRY_INLINE_SIZE = 288; // fits an update of MAX_VAL_SIZE bytes
+constexpr uint64_t LOG_RING_SIZE = 1 << 20;   // log buffer bytes
+constexpr uint64_t LOG_BLOCK_SIZE = 4096;     // log file write unit
+// Log file size, a multiple of LOG_BLOCK_SIZE; tests build with smaller
+// segments through -DDB_LOG_SEGMENT_SIZE
+#ifndef DB_LOG_SEGMENT_SIZE
+#define DB_LOG_SEGMENT_SIZE (16 << 20)
+#endif
+constexpr uint64_t LOG_SEGMENT_SIZE = DB_LOG_SEGMENT_SIZE;
+constexpr uint64_t LOG_SPARE_SEGMENTS = 4;      // old segments kept for reuse
+constexpr uint64_t LOG_FRAME_SIZE = 4 << 10;    // log bytes compressed together, divides LOG_SEGMENT_SIZE
+static_assert(LOG_SEGMENT_SIZE % LOG_BLOCK_SIZE == 0 && LOG_SEGMENT_SIZE % LOG_FRAME_SIZE == 0,
+    "LOG_SEGMENT_SIZE must be a multiple of LOG_BLOCK_SIZE and LOG_FRAME_SIZE");
+constexpr uint64_t LOG_CHECKPOINT_INTERVAL = 32 << 20; // log bytes between checkpoints
+constexpr int REDO_THREADS = 4;       // 1 redoes in the recovering thread
+constexpr size_t REDO_QUEUE_SIZE = 1024; // records waiting per redo thread
+constexpr int UNDO_THREADS = 4;
+constexpr uint64_t UNDO_READ_SIZE = 64 << 10; // log bytes an undo thread reads at once
+
+// Open the log file with O_DIRECT, the log buffer is block aligned for it
+#define LOG_DIRECT_IO 0
+// Write updates in the compact format, 0 writes the fixed one. Both are read.
+#define LOG_COMPACT_UPDATES 1
+// Compress the log in LOG_FRAME_SIZE frames as it is written
+#ifndef LOG_COMPRESS
+#define LOG_COMPRESS 0
+#endif
+
+#if LOG_COMPRESS && LOG_DIRECT_IO
+#error "LOG_COMPRESS writes frames of any length, which O_DIRECT can't"
+#endif
 
+// Records up to LOG_ENTRY_INLINE_SIZE bytes live in the entry itself,
+// so logging an update allocates nothing. A view reads a record where it
+// already is, without copying or owning it.
+// A fixed update has a 48 byte header and both images. A compact one has
+// the 28 byte header, then varints for the table, page, key, and the
+// offset and length in the key's value of the bytes that changed, then
+// those bytes of old XOR new, which redo and undo alike XOR in. The key
+// names the record, as structure modifications move slots.
 class log_entry_t{
 public:
     char *data;
     log_entry_t();
     log_entry_t(int data_length, int compensate);
     log_entry_t(int size);
+    explicit log_entry_t(char* view);
+    log_entry_t(log_entry_t&& other);
+    log_entry_t(const log_entry_t&) = delete;
+    log_entry_t& operator=(const log_entry_t&) = delete;
     ~log_entry_t();
 
     // getters
@@ -31,12 +80,15 @@ public:
     uint64_t get_prev_lsn() const;
     int get_trx_id() const;
     int get_type() const;
+    bool is_compact() const;
     int64_t get_table_id() const;
     pagenum_t get_pagenum() const;
-    uint16_t get_offset() const;
+    int64_t get_key() const;      // compact only
+    uint16_t get_offset() const;  // in the page, or in the key's value if compact
     uint16_t get_length() const;
-    void get_old_image(char *dest) const; // caller allocates
-    void get_new_image(char *dest) const; // caller allocates
+    void get_old_image(char *dest) const; // fixed only, caller allocates
+    void get_new_image(char *dest) const; // fixed only, caller allocates
+    const char* get_diff() const;         // compact only
     uint64_t get_next_undo_lsn() const;
 
     // setters
@@ -51,19 +103,54 @@ public:
     void set_old_image(const char *src);
     void set_new_image(const char *src);
     void set_next_undo_lsn(uint64_t next_undo_lsn);
+
+private:
+    const char* get_compact_fields(uint64_t fields[5]) const;
+    uint64_t get_compact_field(int index) const;
+
+    bool is_view = false;
+    char inline_data[LOG_ENTRY_INLINE_SIZE];
 };
 
-log_entry_t* create_begin_log(int trx_id);
-log_entry_t* create_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char *old, const char *new_);
-log_entry_t* create_commit_log(int trx_id);
-log_entry_t* create_rollback_log(int trx_id);
-log_entry_t* create_compensate_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char *old, const char *new_, uint64_t next_undo_lsn);
+log_entry_t create_begin_log(int trx_id);
+log_entry_t create_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char *old, const char *new_);
+log_entry_t create_commit_log(int trx_id);
+log_entry_t create_rollback_log(int trx_id);
+log_entry_t create_checkpoint_log();
+log_entry_t create_compensate_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char *old, const char *new_, uint64_t next_undo_lsn);
+log_entry_t create_compact_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key, uint16_t length, const char *old, const char *new_);
+// Update of key's value, which sits at offset in the page, in the format
+// LOG_COMPACT_UPDATES picks
+log_entry_t create_slot_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key, uint16_t offset, uint16_t length, const char *old, const char *new_);
+// CLR undoing an update applied on pagenum, in the update's format
+log_entry_t create_compensate_log(const log_entry_t& undone, pagenum_t pagenum);
+// Applies an update or CLR to its page, or takes an update back for undo.
+// False if a compact record's key is not on the page.
+bool log_apply(const log_entry_t& log, page_t* page, bool undo);
+
+// Structure modifications run as nested top actions. The pages changed
+// between smo_begin and smo_end stay on the buffer until smo_end logs
+// their new bytes in one redo-only record, so a crash keeps all of the
+// modification or none of it. Transactions are kept off the trees
+// meanwhile, their record locks name slots the modification moves:
+// smo_begin takes a latch exclusively that transactions hold shared
+// while they read or change a record.
+void smo_begin();
+void smo_end();
+void smo_shared_begin();
+void smo_shared_end();
 
-uint64_t add_to_log_buffer(log_entry_t *log);
-void log_write(log_entry_t *log);
+uint64_t add_to_log_buffer(log_entry_t& log);
+void log_write(uint64_t start_lsn, uint64_t end_lsn);
+void* log_writer_main(void* arg);
+void log_flush_until(uint64_t lsn);
 void log_flush();
+uint64_t log_next_lsn();
+void log_checkpoint();
+void* checkpointer_main(void* arg);
 int init_recovery(char * log_path);
 int shutdown_recovery();
+int log_remove(char* log_path); // deletes the segments and the master record
 
 void recover_main(char* logmsg_path, int flag, int log_num);
 
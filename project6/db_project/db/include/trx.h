@@ -2,6 +2,7 @@
 #define __TRX_H__
 
 #include "lock_table.h"
+#include "deadlock.h"
 #include <pthread.h>
 #include <unordered_map>
 #include <set>
@@ -11,20 +12,44 @@
 
 struct trx_entry_t{
     int trx_id;
-    // pthread_mutex_t trx_mutex; // Not needed for project 5, only one thread per trx
+    // Guards lock, locks and waiting_lock. Other threads add locks through
+    // implicit to explicit conversion and look at waiting_lock to wake us up.
+    pthread_mutex_t trx_latch;
     lock_t* lock;
-    std::set<uint64_t> wait_for;
+    lock_t* waiting_lock; // set while blocked in trx_sleep
+    std::atomic<bool> abort_requested; // deadlock victim or wounded, aborts at its next wait
     std::map<std::pair<std::pair<int64_t, pagenum_t>, std::pair<int64_t, int>>, lock_t*> locks;
     std::map<std::pair<std::pair<int64_t, pagenum_t>, int64_t>, std::pair<uint16_t, char*>> logs;
+    std::vector<fast_lock_ref_t> fast_locks;
+    std::atomic<uint64_t> first_lsn; // begin record, 0 until it is logged
+    std::atomic<uint64_t> last_lsn;
+};
+
+// Active transaction table entry, written by checkpoints
+struct att_entry_t {
+    int trx_id;
+    uint64_t first_lsn;
     uint64_t last_lsn;
 };
 
+// Number of active transactions per trx_id % ACTIVE_TRX_RING, so that an
+// implicit lock can be ruled out without looking the writer up
+constexpr int ACTIVE_TRX_RING = 4096;
+
+// Active transactions, split by trx_id so that transactions beginning and
+// ending on different threads don't contend
+constexpr int TRX_TABLE_SHARDS = 64;
+
+struct trx_table_shard_t{
+    pthread_mutex_t latch;
+    std::unordered_map<int, trx_entry_t*> entries;
+};
+
 // Helper Functions
-bool conflict_exists(hash_table_entry_t* list, lock_t* lock);
-void update_wait_for_graph(hash_table_entry_t* list, lock_t* lock);
-bool detect_deadlock(int trx_id);
+std::vector<int> get_blockers(hash_table_entry_t* list, lock_t* lock);
+void request_abort(int trx_id);
 void release_locks(trx_entry_t* trx);
-void add_to_trx_list(trx_entry_t *trx, hash_table_entry_t *list, lock_t* lock);
+void add_to_trx_list(trx_entry_t *trx, lock_t* lock);
 
 // API Supported
 void trx_add_to_locks(int trx_id, int64_t key, lock_t* lock);
@@ -35,18 +60,21 @@ lock_t* trx_get_lock(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_i
 int trx_acquire(int trx_id, lock_t* lock);
 int trx_abort(int trx_id);
 trx_entry_t* trx_check_active(int trx_id);
-int trx_implicit_to_explicit(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, int trx_written);
-void trx_sleep(int trx_id);
+trx_entry_t* trx_get_entry(int trx_id);
+bool trx_maybe_active(int trx_id);
+int trx_implicit_to_explicit(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_written);
+int trx_sleep(int trx_id);
 
-int trx_init();
+int trx_init(int policy = DEADLOCK_DETECT);
 int trx_shutdown();
 int trx_begin(void);
 int trx_commit(int trx_id);
 void trx_resurrect(int trx_id, uint64_t lsn);
 void trx_remove(int trx_id);
+std::vector<att_entry_t> trx_snapshot();
 
-extern std::unordered_map<int, trx_entry_t*> trx_table;
-extern pthread_mutex_t trx_table_latch;
-extern int trx_id;
+extern trx_table_shard_t trx_table[TRX_TABLE_SHARDS];
+extern std::atomic<int> trx_id;
+extern int deadlock_policy;
 
 #endif //__TRX_H__
\ No newline at end of file
@@ -1,8 +1,11 @@
 #include "buffer.h"
 #include "recovery.h"
+#include <atomic>
+#include <set>
 #define DEBUG_MODE 0
 
 std::unordered_map<int64_t, int64_t> table_id_map;
+std::unordered_map<int64_t, catalog_ref_t> catalog_map;
 
 int buf_size;
 std::vector<control_block_t*> buffer_ctrl_blocks;
@@ -13,6 +16,16 @@ std::map<std::pair<int64_t, pagenum_t>, control_block_t*> pagemap;
 
 pthread_mutex_t buffer_manager_latch;
 
+// Checksums are on by default, this holds the files that turned them off
+std::set<int64_t> checksum_disabled;
+std::atomic<uint64_t> checksum_stamped(0);
+std::atomic<uint64_t> checksum_verified(0);
+std::atomic<uint64_t> checksum_failures(0);
+
+// Pages the thread's open structure modification latched or changed
+thread_local bool tracking = false;
+thread_local std::vector<tracked_page_t> tracked_pages;
+
 void move_to_beg_of_list(control_block_t* cur) {
     if (cur == victim) {
         victim = victim->prev;
@@ -38,13 +51,104 @@ control_block_t* find_buffer(int64_t table_id, pagenum_t page_number) {
     return it->second;
 }
 
-// Wait for eviction victim.
+static void init_ctrl_block(control_block_t* cur, page_t* frame) {
+    cur->frame = frame;
+    cur->table_id = -1;
+    cur->pagenum = 0;
+    cur->is_dirty = 0;
+    cur->tid = -1;
+    cur->rec_lsn = LSN_NONE;
+    cur->fix_lsn = LSN_NONE;
+    cur->tracked = false;
+    cur->checksum = true;
+    cur->corrupted = false;
+    pthread_mutex_init(&cur->page_latch, NULL);
+}
+
+// Adds a frame at the beginning of the list, for when every frame holds
+// a page of an open structure modification
+static control_block_t* add_frame() {
+    page_t* frame = new page_t;
+    control_block_t* cur = new control_block_t;
+    init_ctrl_block(cur, frame);
+    cur->prev = victim;
+    cur->next = victim->next;
+    cur->next->prev = cur;
+    victim->next = cur;
+    buffer.push_back(frame);
+    buffer_ctrl_blocks.push_back(cur);
+    buf_size++;
+    return cur;
+}
+
+// Wait for eviction victim, the least recently used frame that is not
+// kept for a structure modification.
 control_block_t* find_victim() {
     control_block_t* cur = victim;
+    for (int i = 1; i < buf_size && cur->tracked; i++) cur = cur->prev;
+    if (cur->tracked) cur = add_frame();
     pthread_mutex_lock(&cur->page_latch);
     return cur;
 }
 
+static tracked_page_t* find_tracked(control_block_t* cur) {
+    for (tracked_page_t& page : tracked_pages) {
+        if (page.ctrl_block == cur) return &page;
+    }
+    return nullptr;
+}
+
+// Keeps the image of a page from before the structure modification
+// latched it, the frame is latched. A latched frame is never a victim.
+static void track_latched(control_block_t* cur, int64_t tid) {
+    if (!tracking || find_tracked(cur) != nullptr) return;
+    tracked_pages.push_back({ cur, tid, *cur->frame, false });
+    cur->tracked = true;
+}
+
+// A changed page stays tracked and on the buffer, an unchanged one may go
+static void track_returned(control_block_t* cur, int is_dirty) {
+    tracked_page_t* page = find_tracked(cur);
+    if (page == nullptr) return;
+    if (is_dirty) {
+        page->changed = true;
+    } else if (!page->changed) {
+        cur->tracked = false;
+        *page = tracked_pages.back();
+        tracked_pages.pop_back();
+    }
+}
+
+// Write a dirty frame back to its file, stamping the page checksum.
+// The checkpoint thread calls this without the buffer manager latch.
+void write_back_frame(control_block_t* cur) {
+    if (cur->checksum) {
+        PageIO::Checksum::stamp(cur->frame);
+        checksum_stamped++;
+    } else {
+        PageIO::Checksum::set(cur->frame, 0);
+    }
+    file_write_page(cur->table_id, cur->pagenum, cur->frame);
+}
+
+// Read a page into the frame, verifying its checksum.
+// A failed read or a mismatch is retried once to rule out a torn read.
+// Returns false if the page is still bad, the frame keeps what was read.
+bool read_into_frame(control_block_t* cur, int64_t table_id, pagenum_t page_number) {
+    cur->checksum = checksum_disabled.find(table_id) == checksum_disabled.end();
+    for (int attempt = 0; attempt < 2; attempt++) {
+        bool ok = file_read_page(table_id, page_number, cur->frame);
+        if (ok && !cur->checksum) return true;
+        if (ok && PageIO::Checksum::verify(cur->frame)) {
+            checksum_verified++;
+            return true;
+        }
+        checksum_failures++;
+    }
+    std::cout << "[ERROR] Corrupted page " << page_number << " in table file " << table_id << " at " << __func__ << std::endl;
+    return false;
+}
+
 // Add a new page to the buffer
 // If the buffer is full, replace the least recently used page
 control_block_t* add_new_page(int64_t table_id, pagenum_t page_number) {
@@ -52,146 +156,322 @@ control_block_t* add_new_page(int64_t table_id, pagenum_t page_number) {
 
     if (cur->is_dirty) {
         log_flush();
-        file_write_page(cur->table_id, cur->pagenum, cur->frame);
+        write_back_frame(cur);
     }
     if (cur->table_id >= 0){
         pagemap.erase(std::make_pair(cur->table_id, cur->pagenum));
     }
     move_to_beg_of_list(cur);
 
-    file_read_page(table_id, page_number, cur->frame);
+    cur->corrupted = !read_into_frame(cur, table_id, page_number);
     pagemap.emplace(std::make_pair(table_id, page_number), cur);
     cur->table_id = table_id;
     cur->pagenum = page_number;
     cur->is_dirty = 0;
+    cur->tid = -1;
+    cur->rec_lsn = LSN_NONE;
     return cur;
 }
 
-// Frees page from buffered header
-// Call file_free_page if the header is not present in the buffer
-void free_page(int64_t table_id, pagenum_t page_number) {
-    control_block_t* header_ctrl_block = find_buffer(table_id, 0);
-    if (header_ctrl_block == nullptr) {
-        file_free_page(table_id, page_number);
-        return;
-    }
+/* Latches the frame of the page, reading it in if it is not on the buffer.
+ * Called with the buffer manager latch held, tid is the table the page
+ * is read for.
+ */
+static control_block_t* latch_frame(int64_t tid, int64_t table_id, pagenum_t page_number) {
+    control_block_t* cur = find_buffer(table_id, page_number);
 
-    pthread_mutex_lock(&header_ctrl_block->page_latch);
-    page_t free_page;
-    PageIO::FreePage::set_next_free_pagenum(&free_page, PageIO::HeaderPage::get_free_pagenum(header_ctrl_block->frame));
-    pagemap[std::make_pair(table_id, page_number)]->frame->set_data(reinterpret_cast<const char*>(&free_page), 0, PAGE_SIZE);
+    if (cur == nullptr) {
+        cur = add_new_page(table_id, page_number);
+    } else {
+        move_to_beg_of_list(cur);
+        pthread_mutex_lock(&cur->page_latch);
+    }
 
-    PageIO::HeaderPage::set_free_pagenum(header_ctrl_block->frame, page_number);
-    header_ctrl_block->is_dirty |= 1;
-    pthread_mutex_unlock(&header_ctrl_block->page_latch);
+    cur->tid = tid;
+    cur->fix_lsn = log_next_lsn();
+    track_latched(cur, tid);
+    return cur;
 }
 
 void buf_return_ctrl_block(control_block_t** ctrl_block, int is_dirty) {
     if (ctrl_block == nullptr || (*ctrl_block) == nullptr) return;
     
-    (*ctrl_block)->is_dirty |= is_dirty;
     control_block_t* tmp = *ctrl_block;
+    if (tracking) track_returned(tmp, is_dirty);
+    // Records logged while latched come after fix_lsn. rec_lsn is set
+    // before fix_lsn is cleared, so a checkpoint always sees one of them.
+    if (is_dirty && tmp->rec_lsn == LSN_NONE) tmp->rec_lsn = tmp->fix_lsn.load();
+    tmp->is_dirty |= is_dirty;
+    tmp->fix_lsn = LSN_NONE;
     (*ctrl_block) = nullptr;
     pthread_mutex_unlock(&(tmp->page_latch));
 }
 
+// For pages changed by the log record at rec_lsn rather than by a new
+// one, i.e. by redo
+void buf_mark_dirty(control_block_t* ctrl_block, uint64_t rec_lsn) {
+    ctrl_block->is_dirty = 1;
+    if (rec_lsn < ctrl_block->rec_lsn) ctrl_block->rec_lsn = rec_lsn;
+}
+
+/* Writes back the dirty pages that have been dirty since before rec_lsn.
+ * Hot pages are rarely evicted, so checkpoints call this to keep them
+ * from holding back the redo start.
+ */
+void buf_flush_old_pages(uint64_t rec_lsn) {
+    std::vector<std::pair<int64_t, pagenum_t>> pages;
+    pthread_mutex_lock(&buffer_manager_latch);
+    for (control_block_t* cur : buffer_ctrl_blocks) {
+        if (cur->table_id >= 0 && cur->rec_lsn < rec_lsn) pages.push_back({ cur->table_id, cur->pagenum });
+    }
+    pthread_mutex_unlock(&buffer_manager_latch);
+
+    for (auto& page : pages) {
+        pthread_mutex_lock(&buffer_manager_latch);
+        control_block_t* cur = find_buffer(page.first, page.second);
+        if (cur == nullptr) {
+            pthread_mutex_unlock(&buffer_manager_latch);
+            continue;
+        }
+        pthread_mutex_lock(&cur->page_latch);
+        pthread_mutex_unlock(&buffer_manager_latch);
+
+        if (cur->is_dirty && cur->rec_lsn < rec_lsn && !cur->tracked) {
+            log_flush();
+            write_back_frame(cur);
+            cur->is_dirty = 0;
+            cur->rec_lsn = LSN_NONE;
+        }
+        pthread_mutex_unlock(&cur->page_latch);
+    }
+}
+
+/* Dirty page table for a fuzzy checkpoint. A latched page may be dirtied
+ * by its holder, so it counts as dirty since it was latched. File ids
+ * don't last past a restart, so a page is saved under the table it was
+ * last read for, any table of its file; recovery maps it to the file.
+ */
+std::vector<dpt_entry_t> buf_get_dirty_pages() {
+    std::vector<dpt_entry_t> pages;
+    pthread_mutex_lock(&buffer_manager_latch);
+    for (control_block_t* cur : buffer_ctrl_blocks) {
+        if (cur->table_id < 0 || cur->tid < 0) continue;
+        uint64_t fix_lsn = cur->fix_lsn;
+        uint64_t rec_lsn = std::min(fix_lsn, cur->rec_lsn.load());
+        if (rec_lsn != LSN_NONE) pages.push_back({ cur->tid, cur->pagenum, rec_lsn });
+    }
+    pthread_mutex_unlock(&buffer_manager_latch);
+    return pages;
+}
+
 /* Calls file_open_table_file and maps table_id with table index.
+ * A new file is created in the compressed format if compressed is set.
  */
-int64_t buf_open_table_file(const char* pathname, int64_t tid) {
-    int64_t table_id = file_open_table_file(pathname);
+int64_t buf_open_table_file(const char* pathname, int64_t tid, bool compressed) {
+    int64_t table_id = compressed ? file_open_compressed_table_file(pathname) : file_open_table_file(pathname);
     table_id_map[tid] = table_id;
     if (table_id < 0) return -1;
     return table_id;
 }
 
+/* Opens a tablespace file and maps every table listed in its catalog.
+ * Reads the catalog directly from the file, so it can be called before
+ * buf_init_db() to let recovery find the tables of the tablespace.
+ * Returns the tablespace id, which is shared by all of its tables.
+ */
+int64_t buf_open_tablespace_file(const char* pathname) {
+    int64_t tablespace_id = file_open_tablespace_file(pathname);
+    if (tablespace_id < 0) return -1;
+
+    page_t header, catalog;
+    file_read_page(tablespace_id, 0, &header);
+    pagenum_t catalog_pagenum = PageIO::HeaderPage::get_catalog_pagenum(&header);
+    file_read_page(tablespace_id, catalog_pagenum, &catalog);
+
+    int num_entries = PageIO::CatalogPage::get_num_entries(&catalog);
+    for (int i = 0; i < num_entries; i++) {
+        int64_t tid = PageIO::CatalogPage::get_nth_table_id(&catalog, i);
+        table_id_map[tid] = tablespace_id;
+        catalog_map[tid] = { catalog_pagenum, i };
+    }
+    return tablespace_id;
+}
 
-/* Returns the pointer to the control block with given table_id and page_number.
- * Eviction of victim page can occur if page required is not on the buffer.
+/* Maps table tid to the tablespace, adding a catalog entry if the table
+ * does not exist in the tablespace yet.
  */
-control_block_t* buf_read_page(int64_t table_id, pagenum_t page_number) {
-    table_id = table_id_map[table_id];
-    pthread_mutex_lock(&buffer_manager_latch);
+int64_t buf_open_table_in_tablespace(int64_t tablespace_id, int64_t tid) {
+    auto it = table_id_map.find(tid);
+    if (it != table_id_map.end()) {
+        if (it->second == tablespace_id && catalog_map.find(tid) != catalog_map.end()) return tid;
+        return -1;
+    }
 
-    control_block_t* cur = find_buffer(table_id, page_number);
+    table_id_map[tid] = tablespace_id;
+    control_block_t* header_ctrl_block = buf_read_page(tid, 0);
+    pagenum_t catalog_pagenum = PageIO::HeaderPage::get_catalog_pagenum(header_ctrl_block->frame);
+    buf_return_ctrl_block(&header_ctrl_block);
+    if (catalog_pagenum == 0) {
+        table_id_map.erase(tid);
+        return -1;
+    }
 
-    if (cur == nullptr) {
-        cur = add_new_page(table_id, page_number);
-        pthread_mutex_unlock(&buffer_manager_latch);
-        return cur;
+    control_block_t* catalog_ctrl_block = buf_read_page(tid, catalog_pagenum);
+    int num_entries = PageIO::CatalogPage::get_num_entries(catalog_ctrl_block->frame);
+    if (num_entries == CATALOG_MAX_ENTRIES) {
+        buf_return_ctrl_block(&catalog_ctrl_block);
+        table_id_map.erase(tid);
+        return -1;
     }
+    PageIO::CatalogPage::set_nth_table_id(catalog_ctrl_block->frame, num_entries, tid);
+    PageIO::CatalogPage::set_nth_root_pagenum(catalog_ctrl_block->frame, num_entries, 0);
+    PageIO::CatalogPage::set_num_entries(catalog_ctrl_block->frame, num_entries + 1);
+    buf_return_ctrl_block(&catalog_ctrl_block, 1);
 
-    move_to_beg_of_list(cur);
+    catalog_map[tid] = { catalog_pagenum, num_entries };
+    return tid;
+}
 
-    pthread_mutex_lock(&cur->page_latch);
+bool buf_is_table_open(int64_t tid) {
+    return table_id_map.find(tid) != table_id_map.end();
+}
+
+/* Root of a single table file is kept in its header page,
+ * root of a table in a tablespace is kept in the catalog page.
+ * PAGENUM_CORRUPTED if that page failed its checksum.
+ */
+pagenum_t buf_get_root_pagenum(int64_t table_id) {
+    pagenum_t root_pagenum;
+    auto it = catalog_map.find(table_id);
+    if (it == catalog_map.end()) {
+        control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
+        root_pagenum = header_ctrl_block->corrupted ? PAGENUM_CORRUPTED : PageIO::HeaderPage::get_root_pagenum(header_ctrl_block->frame);
+        buf_return_ctrl_block(&header_ctrl_block);
+    } else {
+        control_block_t* catalog_ctrl_block = buf_read_page(table_id, it->second.catalog_pagenum);
+        root_pagenum = catalog_ctrl_block->corrupted ? PAGENUM_CORRUPTED : PageIO::CatalogPage::get_nth_root_pagenum(catalog_ctrl_block->frame, it->second.slot);
+        buf_return_ctrl_block(&catalog_ctrl_block);
+    }
+    return root_pagenum;
+}
+
+void buf_set_root_pagenum(int64_t table_id, pagenum_t root_pagenum) {
+    auto it = catalog_map.find(table_id);
+    if (it == catalog_map.end()) {
+        control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
+        PageIO::HeaderPage::set_root_pagenum(header_ctrl_block->frame, root_pagenum);
+        buf_return_ctrl_block(&header_ctrl_block, 1);
+    } else {
+        control_block_t* catalog_ctrl_block = buf_read_page(table_id, it->second.catalog_pagenum);
+        PageIO::CatalogPage::set_nth_root_pagenum(catalog_ctrl_block->frame, it->second.slot, root_pagenum);
+        buf_return_ctrl_block(&catalog_ctrl_block, 1);
+    }
+}
+
+
+/* Returns the pointer to the control block with given table_id and page_number.
+ * Eviction of victim page can occur if page required is not on the buffer.
+ */
+control_block_t* buf_read_page(int64_t table_id, pagenum_t page_number) {
+    int64_t tid = table_id;
+    table_id = table_id_map[table_id];
+    pthread_mutex_lock(&buffer_manager_latch);
+    control_block_t* cur = latch_frame(tid, table_id, page_number);
     pthread_mutex_unlock(&buffer_manager_latch);
     return cur;
 }
 
 
+// Starts reading the page from its file if it is not on the buffer
+void buf_prefetch_page(int64_t table_id, pagenum_t page_number) {
+    table_id = table_id_map[table_id];
+    pthread_mutex_lock(&buffer_manager_latch);
+    bool buffered = find_buffer(table_id, page_number) != nullptr;
+    pthread_mutex_unlock(&buffer_manager_latch);
+    if (!buffered) file_prefetch_page(table_id, page_number);
+}
+
+/* Takes a page off the free page list, whose links may only be on the
+ * buffer, or off the high-water mark.
+ */
 pagenum_t buf_alloc_page(int64_t table_id) {
+    int64_t tid = table_id;
     table_id = table_id_map[table_id];
     pthread_mutex_lock(&buffer_manager_latch);
-    control_block_t* header_ctrl_block = find_buffer(table_id, 0);
+    control_block_t* header_ctrl_block = latch_frame(tid, table_id, 0);
 
-    if( header_ctrl_block == nullptr ) {
-        header_ctrl_block = add_new_page(table_id, 0);
-    } else {
-        pthread_mutex_lock(&header_ctrl_block->page_latch);
-    }
     pagenum_t pagenum = PageIO::HeaderPage::get_free_pagenum(header_ctrl_block->frame);
-    if (pagenum == 0) {
-        pagenum_t next_num = PageIO::HeaderPage::get_num_pages(header_ctrl_block->frame);
-        pagenum_t next_size = next_num * 2;
-        while (next_num < next_size)
-        {
-            page_t free_page;
-            PageIO::FreePage::set_next_free_pagenum(&free_page, pagenum);
-            pagenum = next_num;
-            file_write_page(table_id, next_num, &free_page);;
-            next_num++;
-        }
-        PageIO::HeaderPage::set_free_pagenum(header_ctrl_block->frame, pagenum);
-        PageIO::HeaderPage::set_num_pages(header_ctrl_block->frame, next_size);
+    if (pagenum != 0) {
+        control_block_t* free_ctrl_block = latch_frame(tid, table_id, pagenum);
+        PageIO::HeaderPage::set_free_pagenum(header_ctrl_block->frame, PageIO::FreePage::get_next_free_pagenum(free_ctrl_block->frame));
+        buf_return_ctrl_block(&free_ctrl_block);
+    } else {
+        pagenum = file_alloc_from_header(table_id, header_ctrl_block->frame);
     }
 
-    page_t page;
-    file_read_page(table_id, pagenum, &page);
-
-    PageIO::HeaderPage::set_free_pagenum(header_ctrl_block->frame, PageIO::FreePage::get_next_free_pagenum(&page));
-
-    header_ctrl_block->is_dirty |= 1;
-    pthread_mutex_unlock(&header_ctrl_block->page_latch);
     pthread_mutex_unlock(&buffer_manager_latch);
+    buf_return_ctrl_block(&header_ctrl_block, 1);
     return pagenum;
 }
 
+/* Turns page checksums on or off for the file of table_id.
+ * Tables sharing a tablespace share the switch.
+ */
+void buf_set_checksum(int64_t table_id, bool enabled) {
+    table_id = table_id_map[table_id];
+    pthread_mutex_lock(&buffer_manager_latch);
+    if (enabled) {
+        checksum_disabled.erase(table_id);
+    } else {
+        checksum_disabled.insert(table_id);
+    }
+    for (control_block_t* cur : buffer_ctrl_blocks) {
+        if (cur->table_id == table_id) cur->checksum = enabled;
+    }
+    pthread_mutex_unlock(&buffer_manager_latch);
+}
+
+buf_checksum_stats_t buf_get_checksum_stats() {
+    return { checksum_stamped.load(), checksum_verified.load(), checksum_failures.load() };
+}
+
+/* Links the page into the free page list. Both pages are changed on the
+ * buffer like any other, so the change is logged with the structure
+ * modification freeing the page.
+ */
 void buf_free_page(int64_t table_id, pagenum_t page_number)
 {
+    int64_t tid = table_id;
     table_id = table_id_map[table_id];
     pthread_mutex_lock(&buffer_manager_latch);
-    control_block_t* cur = find_buffer(table_id, page_number);
+    control_block_t* header_ctrl_block = latch_frame(tid, table_id, 0);
+    control_block_t* ctrl_block = latch_frame(tid, table_id, page_number);
+    pthread_mutex_unlock(&buffer_manager_latch);
 
-    if (cur == nullptr) {
-        // Simple case: just free it
-        free_page(table_id, page_number);
-        pthread_mutex_unlock(&buffer_manager_latch);
-        return;
-    }
+    *ctrl_block->frame = page_t();
+    PageIO::FreePage::set_next_free_pagenum(ctrl_block->frame, PageIO::HeaderPage::get_free_pagenum(header_ctrl_block->frame));
+    PageIO::HeaderPage::set_free_pagenum(header_ctrl_block->frame, page_number);
+    buf_return_ctrl_block(&ctrl_block, 1);
+    buf_return_ctrl_block(&header_ctrl_block, 1);
+}
 
-    // page already on the buffer
-    pagemap.erase(std::make_pair(table_id, page_number));
+void buf_track_begin() {
+    tracked_pages.clear();
+    tracking = true;
+}
 
-    move_to_beg_of_list(cur);
-    victim = cur;
-    
-    // Empty the buffer
-    std::memset(cur->frame, 0, PAGE_SIZE);
-    cur->table_id = -1;
-    cur->pagenum = 0;
-    cur->is_dirty = 0;
+std::vector<tracked_page_t>& buf_tracked_pages() {
+    return tracked_pages;
+}
 
-    free_page(table_id, page_number);
-    pthread_mutex_unlock(&buffer_manager_latch);
+void buf_track_end() {
+    for (tracked_page_t& page : tracked_pages) {
+        pthread_mutex_lock(&page.ctrl_block->page_latch);
+        page.ctrl_block->tracked = false;
+        pthread_mutex_unlock(&page.ctrl_block->page_latch);
+    }
+    tracked_pages.clear();
+    tracking = false;
 }
 
 /* Initialzer for buffer and buffer control blocks.
@@ -214,11 +494,7 @@ int buf_init_db(int num_buf) {
         }
     }
     for (int i = 0; i < num_buf; i++) {
-        buffer_ctrl_blocks[i]->frame = buffer[i];
-        buffer_ctrl_blocks[i]->table_id = -1;
-        buffer_ctrl_blocks[i]->pagenum = 0;
-        buffer_ctrl_blocks[i]->is_dirty = 0;
-        pthread_mutex_init(&buffer_ctrl_blocks[i]->page_latch, NULL);
+        init_ctrl_block(buffer_ctrl_blocks[i], buffer[i]);
         buffer_ctrl_blocks[i]->next = buffer_ctrl_blocks[(i + num_buf - 1) % num_buf];
         buffer_ctrl_blocks[i]->prev = buffer_ctrl_blocks[(i + 1) % num_buf];
     }
@@ -233,7 +509,7 @@ int buf_shutdown_db() {
     for (int i = 0; i < buf_size; i++) {
         control_block_t* cur = buffer_ctrl_blocks[i];
         if (cur->is_dirty > 0) {
-            file_write_page(cur->table_id, cur->pagenum, cur->frame);
+            write_back_frame(cur);
         }
         pthread_mutex_destroy(&cur->page_latch);
         delete cur->frame;
@@ -241,6 +517,8 @@ int buf_shutdown_db() {
     }
 
     table_id_map.clear();
+    catalog_map.clear();
+    checksum_disabled.clear();
 
     pthread_mutex_destroy(&buffer_manager_latch);
 
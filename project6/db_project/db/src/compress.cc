@@ -0,0 +1,352 @@
+#include "compress.h"
+#include "file.h"
+
+#include <algorithm>
+#include <atomic>
+#include <string>
+#include <unordered_map>
+
+namespace
+{
+    constexpr int HASH_BITS = 12;
+    constexpr int MIN_MATCH = 4;
+    constexpr int MAX_OFFSET = 65535;
+
+    std::unordered_map<int, compressed_file_t*> compressed_files;
+    std::atomic<uint64_t> logical_bytes(0);
+    std::atomic<uint64_t> physical_bytes(0);
+
+    bool put_length(char* dst, int& op, int cap, int len)
+    {
+        while (len >= 255)
+        {
+            if (op >= cap) return false;
+            dst[op++] = static_cast<char>(255);
+            len -= 255;
+        }
+        if (op >= cap) return false;
+        dst[op++] = static_cast<char>(len);
+        return true;
+    }
+
+    bool get_length(const char* src, int& ip, int n, int& len)
+    {
+        uint8_t b;
+        do
+        {
+            if (ip >= n) return false;
+            b = static_cast<uint8_t>(src[ip++]);
+            len += b;
+        } while (b == 255);
+        return true;
+    }
+
+    // Literals [anchor, anchor + lit), then a match unless match_len == 0
+    bool emit_sequence(const char* src, int anchor, int lit, int offset, int match_len, char* dst, int& op, int cap)
+    {
+        int token_op = op;
+        if (op >= cap) return false;
+        op++;
+        uint8_t token = (lit >= 15 ? 15 : lit) << 4;
+        if (lit >= 15 && !put_length(dst, op, cap, lit - 15)) return false;
+        if (op + lit > cap) return false;
+        std::memcpy(dst + op, src + anchor, lit);
+        op += lit;
+        if (match_len > 0)
+        {
+            int ml = match_len - MIN_MATCH;
+            token |= (ml >= 15 ? 15 : ml);
+            if (op + 2 > cap) return false;
+            dst[op++] = static_cast<char>(offset & 0xFF);
+            dst[op++] = static_cast<char>(offset >> 8);
+            if (ml >= 15 && !put_length(dst, op, cap, ml - 15)) return false;
+        }
+        dst[token_op] = static_cast<char>(token);
+        return true;
+    }
+
+    void write_map_entry(compressed_file_t* cf, pagenum_t page_number)
+    {
+        char buf[COMPRESS_MAP_ENTRY_SIZE];
+        const extent_t& e = cf->map[page_number];
+        std::memcpy(buf + 0, &e.offset, 8);
+        std::memcpy(buf + 8, &e.length, 4);
+        std::memcpy(buf + 12, &e.units, 2);
+        std::memcpy(buf + 14, &e.codec, 2);
+        FileIO::write(cf->map_fd, buf, COMPRESS_MAP_ENTRY_SIZE, page_number * COMPRESS_MAP_ENTRY_SIZE);
+        physical_bytes += COMPRESS_MAP_ENTRY_SIZE;
+    }
+
+    uint64_t take_extent(compressed_file_t* cf, uint16_t units)
+    {
+        for (uint64_t u = units; u <= COMPRESS_MAX_UNITS; u++)
+        {
+            std::vector<uint64_t>& list = cf->free_extents[u];
+            if (list.empty()) continue;
+            uint64_t offset = list.back();
+            list.pop_back();
+            if (u > units)
+            {
+                // Split, the tail goes back to the free lists
+                cf->free_extents[u - units].push_back(offset + units * COMPRESS_UNIT);
+            }
+            return offset;
+        }
+        uint64_t offset = cf->end;
+        cf->end += units * COMPRESS_UNIT;
+        return offset;
+    }
+
+    void rebuild_free_extents(compressed_file_t* cf)
+    {
+        std::vector<std::pair<uint64_t, uint64_t>> used;
+        for (const extent_t& e : cf->map)
+        {
+            if (e.units != 0) used.push_back({ e.offset, e.offset + e.units * COMPRESS_UNIT });
+        }
+        std::sort(used.begin(), used.end());
+
+        uint64_t cursor = COMPRESS_UNIT; // unit 0 is the superblock
+        for (auto const& u : used)
+        {
+            while (cursor < u.first)
+            {
+                uint64_t units = std::min((u.first - cursor) / COMPRESS_UNIT, COMPRESS_MAX_UNITS);
+                cf->free_extents[units].push_back(cursor);
+                cursor += units * COMPRESS_UNIT;
+            }
+            cursor = std::max(cursor, u.second);
+        }
+        cf->end = cursor;
+    }
+
+    compressed_file_t* new_compressed_file(const char* pathname)
+    {
+        std::string map_path = std::string(pathname) + ".map";
+        int map_fd = FileIO::open(map_path.c_str());
+        if (map_fd < 0) return nullptr;
+
+        compressed_file_t* cf = new compressed_file_t;
+        cf->map_fd = map_fd;
+        cf->end = COMPRESS_UNIT;
+        cf->free_extents.resize(COMPRESS_MAX_UNITS + 1);
+        pthread_mutex_init(&cf->latch, NULL);
+        return cf;
+    }
+
+    compressed_file_t* find(int fd)
+    {
+        auto it = compressed_files.find(fd);
+        return it == compressed_files.end() ? nullptr : it->second;
+    }
+}
+
+int Compress::compress(const char* src, int src_size, char* dst, int dst_capacity)
+{
+    int table[1 << HASH_BITS];
+    std::fill(table, table + (1 << HASH_BITS), -1);
+
+    int ip = 0, anchor = 0, op = 0;
+    while (ip + MIN_MATCH <= src_size)
+    {
+        uint32_t seq;
+        std::memcpy(&seq, src + ip, 4);
+        uint32_t h = (seq * 2654435761u) >> (32 - HASH_BITS);
+        int ref = table[h];
+        table[h] = ip;
+        if (ref < 0 || ip - ref > MAX_OFFSET || std::memcmp(src + ref, src + ip, MIN_MATCH) != 0)
+        {
+            ip++;
+            continue;
+        }
+
+        int len = MIN_MATCH;
+        while (ip + len < src_size && src[ref + len] == src[ip + len]) len++;
+
+        if (!emit_sequence(src, anchor, ip - anchor, ip - ref, len, dst, op, dst_capacity)) return 0;
+        ip += len;
+        anchor = ip;
+    }
+    if (!emit_sequence(src, anchor, src_size - anchor, 0, 0, dst, op, dst_capacity)) return 0;
+    return op;
+}
+
+int Compress::decompress(const char* src, int src_size, char* dst, int dst_capacity)
+{
+    int ip = 0, op = 0;
+    while (ip < src_size)
+    {
+        uint8_t token = static_cast<uint8_t>(src[ip++]);
+
+        int lit = token >> 4;
+        if (lit == 15 && !get_length(src, ip, src_size, lit)) return -1;
+        if (ip + lit > src_size || op + lit > dst_capacity) return -1;
+        std::memcpy(dst + op, src + ip, lit);
+        ip += lit;
+        op += lit;
+
+        if (ip == src_size) break; // last sequence has no match
+
+        if (ip + 2 > src_size) return -1;
+        int offset = static_cast<uint8_t>(src[ip]) | (static_cast<uint8_t>(src[ip + 1]) << 8);
+        ip += 2;
+        int len = token & 0x0F;
+        if (len == 15 && !get_length(src, ip, src_size, len)) return -1;
+        len += MIN_MATCH;
+        if (offset == 0 || offset > op || op + len > dst_capacity) return -1;
+
+        // Byte by byte: the match may overlap the bytes it produces
+        for (int i = 0; i < len; i++, op++) dst[op] = dst[op - offset];
+    }
+    return op;
+}
+
+// Whether fd is a compressed file; used before attaching it
+bool Compress::probe(int fd)
+{
+    char magic[sizeof(COMPRESS_MAGIC)];
+    if (FileIO::size(fd) < static_cast<off_t>(COMPRESS_UNIT)) return false;
+    if (!FileIO::read(fd, magic, sizeof(magic), 0)) return false;
+    return std::memcmp(magic, COMPRESS_MAGIC, sizeof(magic)) == 0;
+}
+
+bool Compress::is_compressed(int64_t fd)
+{
+    return find(fd) != nullptr;
+}
+
+// Turn an empty file into a compressed file
+int Compress::create(int fd, const char* pathname)
+{
+    compressed_file_t* cf = new_compressed_file(pathname);
+    if (cf == nullptr) return -1;
+    ftruncate(cf->map_fd, 0);
+
+    char superblock[COMPRESS_UNIT] = {};
+    uint32_t page_size = PAGE_SIZE, unit = COMPRESS_UNIT;
+    std::memcpy(superblock, COMPRESS_MAGIC, sizeof(COMPRESS_MAGIC));
+    std::memcpy(superblock + 8, &page_size, 4);
+    std::memcpy(superblock + 12, &unit, 4);
+    FileIO::write(fd, superblock, COMPRESS_UNIT, 0);
+
+    compressed_files[fd] = cf;
+    return 0;
+}
+
+// Load the page map of an existing compressed file
+int Compress::attach(int fd, const char* pathname)
+{
+    uint32_t page_size;
+    FileIO::read(fd, &page_size, 4, 8);
+    if (page_size != PAGE_SIZE)
+    {
+        std::cout << "[ERROR] " << pathname << " was compressed with page size " << page_size << std::endl;
+        return -1;
+    }
+
+    compressed_file_t* cf = new_compressed_file(pathname);
+    if (cf == nullptr) return -1;
+
+    uint64_t entries = FileIO::size(cf->map_fd) / COMPRESS_MAP_ENTRY_SIZE;
+    std::vector<char> buf(entries * COMPRESS_MAP_ENTRY_SIZE);
+    FileIO::read(cf->map_fd, buf.data(), buf.size(), 0);
+    cf->map.resize(entries);
+    for (uint64_t i = 0; i < entries; i++)
+    {
+        const char* p = buf.data() + i * COMPRESS_MAP_ENTRY_SIZE;
+        extent_t& e = cf->map[i];
+        std::memcpy(&e.offset, p + 0, 8);
+        std::memcpy(&e.length, p + 8, 4);
+        std::memcpy(&e.units, p + 12, 2);
+        std::memcpy(&e.codec, p + 14, 2);
+    }
+    rebuild_free_extents(cf);
+
+    compressed_files[fd] = cf;
+    return 0;
+}
+
+// Pages never written read as zero, like the tail of a sparse file
+bool Compress::read_page(int fd, pagenum_t page_number, char* dest)
+{
+    compressed_file_t* cf = find(fd);
+    pthread_mutex_lock(&cf->latch);
+    extent_t e = page_number < cf->map.size() ? cf->map[page_number] : extent_t{};
+    pthread_mutex_unlock(&cf->latch);
+
+    if (e.length == 0)
+    {
+        std::memset(dest, 0, PAGE_SIZE);
+        return true;
+    }
+    if (e.codec == CODEC_RAW) return FileIO::read(fd, dest, PAGE_SIZE, e.offset);
+
+    char buf[PAGE_SIZE];
+    if (!FileIO::read(fd, buf, e.length, e.offset)) return false;
+    return decompress(buf, e.length, dest, PAGE_SIZE) == static_cast<int>(PAGE_SIZE);
+}
+
+// A page always moves to a fresh extent, so a torn write never hits the
+// only copy. The old extent is only reused once the data and the map
+// entry pointing away from it are synced.
+bool Compress::write_page(int fd, pagenum_t page_number, const char* src)
+{
+    compressed_file_t* cf = find(fd);
+
+    char buf[PAGE_SIZE];
+    // Must save at least one unit, otherwise keep the page as is
+    int length = compress(src, PAGE_SIZE, buf, PAGE_SIZE - COMPRESS_UNIT);
+    uint16_t codec = CODEC_LZ;
+    const char* data = buf;
+    if (length == 0)
+    {
+        length = PAGE_SIZE;
+        codec = CODEC_RAW;
+        data = src;
+    }
+    uint16_t units = (length + COMPRESS_UNIT - 1) / COMPRESS_UNIT;
+
+    pthread_mutex_lock(&cf->latch);
+    if (page_number >= cf->map.size()) cf->map.resize(page_number + 1, extent_t{});
+    extent_t old = cf->map[page_number];
+
+    uint64_t offset = take_extent(cf, units);
+    if (!FileIO::write(fd, data, length, offset))
+    {
+        cf->free_extents[units].push_back(offset);
+        pthread_mutex_unlock(&cf->latch);
+        return false;
+    }
+    cf->map[page_number] = extent_t{ offset, static_cast<uint32_t>(length), units, codec };
+    write_map_entry(cf, page_number);
+
+    if (old.units != 0) cf->pending_free.push_back({ old.offset, old.units });
+    if (cf->pending_free.size() >= COMPRESS_PENDING_FREE)
+    {
+        FileIO::sync(fd);
+        FileIO::sync(cf->map_fd);
+        for (auto const& p : cf->pending_free) cf->free_extents[p.second].push_back(p.first);
+        cf->pending_free.clear();
+    }
+    pthread_mutex_unlock(&cf->latch);
+
+    logical_bytes += PAGE_SIZE;
+    physical_bytes += length;
+    return true;
+}
+
+void Compress::detach_all()
+{
+    for (auto const& it : compressed_files)
+    {
+        // map_fd is closed with the other opened files
+        pthread_mutex_destroy(&it.second->latch);
+        delete it.second;
+    }
+    compressed_files.clear();
+}
+
+compress_stats_t Compress::get_stats()
+{
+    return compress_stats_t{ logical_bytes.load(), physical_bytes.load() };
+}
@@ -0,0 +1,82 @@
+#include "deadlock.h"
+#include <unordered_set>
+
+wait_for_graph_t wait_for_graph;
+
+namespace WaitForGraph
+{
+    int init() {
+        wait_for_graph.nodes.clear();
+        return pthread_mutex_init(&wait_for_graph.latch, NULL);
+    }
+
+    int shutdown() {
+        wait_for_graph.nodes.clear();
+        return pthread_mutex_destroy(&wait_for_graph.latch);
+    }
+
+    void set_waits(int trx_id, const std::vector<int>& holders, size_t cost) {
+        pthread_mutex_lock(&wait_for_graph.latch);
+        wait_for_graph.nodes[trx_id] = { holders, cost };
+        pthread_mutex_unlock(&wait_for_graph.latch);
+    }
+
+    void clear(int trx_id) {
+        pthread_mutex_lock(&wait_for_graph.latch);
+        wait_for_graph.nodes.erase(trx_id);
+        pthread_mutex_unlock(&wait_for_graph.latch);
+    }
+
+    // DFS over blocked transactions only. A running transaction has no out
+    // edges, so the search stays within the waiting part of the graph.
+    std::vector<int> find_cycle(int trx_id) {
+        std::vector<int> path;
+        std::vector<size_t> next_edge;
+        std::unordered_set<int> visited;
+
+        pthread_mutex_lock(&wait_for_graph.latch);
+        path.push_back(trx_id);
+        next_edge.push_back(0);
+        visited.insert(trx_id);
+
+        while (!path.empty()) {
+            auto it = wait_for_graph.nodes.find(path.back());
+            if (it == wait_for_graph.nodes.end() || next_edge.back() >= it->second.waits_for.size()) {
+                path.pop_back();
+                next_edge.pop_back();
+                continue;
+            }
+
+            int next = it->second.waits_for[next_edge.back()++];
+            if (next == trx_id) {
+                pthread_mutex_unlock(&wait_for_graph.latch);
+                return path;
+            }
+            if (visited.insert(next).second) {
+                path.push_back(next);
+                next_edge.push_back(0);
+            }
+        }
+
+        pthread_mutex_unlock(&wait_for_graph.latch);
+        return path;
+    }
+
+    int choose_victim(const std::vector<int>& cycle) {
+        int victim = 0;
+        size_t victim_cost = 0;
+
+        pthread_mutex_lock(&wait_for_graph.latch);
+        for (int trx_id : cycle) {
+            auto it = wait_for_graph.nodes.find(trx_id);
+            if (it == wait_for_graph.nodes.end()) continue;
+            size_t cost = it->second.cost;
+            if (victim == 0 || cost < victim_cost || (cost == victim_cost && trx_id > victim)) {
+                victim = trx_id;
+                victim_cost = cost;
+            }
+        }
+        pthread_mutex_unlock(&wait_for_graph.latch);
+        return victim;
+    }
+}
@@ -1,12 +1,13 @@
 #include "file.h"
 #include "page.h"
+#include "compress.h"
 
 std::vector<int> FileIO::opened_files;
 
 int FileIO::open(const char* filename)
 {
     int fd = ::open(filename, O_RDWR | O_CREAT, 0644);
-    opened_files.push_back(fd);
+    if (fd >= 0) opened_files.push_back(fd);
     return fd;
 }
 off_t FileIO::size(int fd)
@@ -16,72 +17,216 @@ off_t FileIO::size(int fd)
     lseek(fd, offset, SEEK_SET);           // seek back to where it was
     return sz;
 }
-void FileIO::write(int fd, const void* src, int n, int offset)
+bool FileIO::write(int fd, const void* src, int n, off_t offset)
 {
-    pwrite(fd, src, n, offset);
-    // sync();
+    const char* p = reinterpret_cast<const char*>(src);
+    while (n > 0)
+    {
+        ssize_t written = pwrite(fd, p, n, offset);
+        if (written < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        p += written;
+        n -= written;
+        offset += written;
+    }
+    return true;
+}
+// Returns false on I/O error. Bytes past the end of file read as zero.
+bool FileIO::read(int fd, void* dst, int n, off_t offset)
+{
+    char* p = reinterpret_cast<char*>(dst);
+    while (n > 0)
+    {
+        ssize_t got = pread(fd, p, n, offset);
+        if (got < 0)
+        {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        if (got == 0)
+        {
+            std::memset(p, 0, n);
+            break;
+        }
+        p += got;
+        n -= got;
+        offset += got;
+    }
+    return true;
+}
+void FileIO::allocate(int fd, off_t size)
+{
+    if (fallocate(fd, 0, 0, size) != 0)
+    {
+        // Filesystem without fallocate support: extend the file sparsely
+        if (FileIO::size(fd) < size) ftruncate(fd, size);
+    }
+}
+void FileIO::prefetch(int fd, int n, off_t offset)
+{
+    posix_fadvise(fd, offset, n, POSIX_FADV_WILLNEED);
 }
-void FileIO::read(int fd, void* dst, int n, int offset)
+void FileIO::sync(int fd)
 {
-    pread(fd, dst, n, offset);
+    fdatasync(fd);
 }
 void FileIO::close(int fd)
 {
     ::close(fd);
 }
 
+// A file can only be used by a build with the page size it was created with
+bool file_check_page_size(int64_t table_id, const char* pathname)
+{
+    page_t header;
+    file_read_page(table_id, 0, &header);
+    uint64_t page_size = PageIO::HeaderPage::get_page_size(&header);
+    if (page_size != PAGE_SIZE)
+    {
+        std::cout << "[ERROR] " << pathname << " has " << page_size << " byte pages, built for " << PAGE_SIZE << std::endl;
+        return false;
+    }
+    return true;
+}
+
 // Open existing database file or create one if not existed.
 int64_t file_open_table_file(const char* pathname)
 {
     int64_t fd = FileIO::open(pathname);
-    if (FileIO::size(fd) == 0)
+    if (fd < 0) return -1;
+    if (Compress::probe(fd))
+    {
+        if (Compress::attach(fd, pathname) != 0) return -1;
+    }
+    else if (FileIO::size(fd) == 0)
     {
         // defult size = 10MiB = 2560 pages (including header)
+        // Pages are preallocated but not linked; they are handed out
+        // from the high-water mark by file_alloc_from_header()
+        FileIO::allocate(fd, INITIAL_SIZE);
+
         page_t header;
-        for (pagenum_t pagenum = INITIAL_FREE_PAGES; pagenum > 0; pagenum--)
-        {
-            page_t free_page;
-            PageIO::FreePage::set_next_free_pagenum(&free_page, pagenum - 1);
-            FileIO::write(fd, &free_page, PAGE_SIZE, pagenum * PAGE_SIZE);
-        }
         PageIO::HeaderPage::set_num_pages(&header, INITIAL_FREE_PAGES + 1);
-        PageIO::HeaderPage::set_free_pagenum(&header, INITIAL_FREE_PAGES);
+        PageIO::HeaderPage::set_free_pagenum(&header, 0);
+        PageIO::HeaderPage::set_high_water_mark(&header, 1);
+        PageIO::HeaderPage::set_page_size(&header, PAGE_SIZE);
         FileIO::write(fd, &header, PAGE_SIZE, 0);
+        FileIO::sync(fd);
     }
 
-    sync();
+    if (!file_check_page_size(fd, pathname)) return -1;
     return fd;
 }
 
-// Allocate an on-disk page from the free page list
-pagenum_t file_alloc_page(int64_t table_id)
+// Open existing database file or create a compressed one if not existed.
+// Pages are stored compressed in variable-size extents, and a sidecar
+// map file (pathname + ".map") records where each page lives.
+int64_t file_open_compressed_table_file(const char* pathname)
 {
-    page_t header_page;
-    FileIO::read(table_id, &header_page, PAGE_SIZE, 0);
+    int64_t fd = FileIO::open(pathname);
+    if (fd < 0) return -1;
+    if (FileIO::size(fd) != 0)
+    {
+        // An existing file keeps the format it was created with
+        if (Compress::probe(fd) && Compress::attach(fd, pathname) != 0) return -1;
+        if (!file_check_page_size(fd, pathname)) return -1;
+        return fd;
+    }
+
+    if (Compress::create(fd, pathname) != 0) return -1;
 
-    pagenum_t free_pagenum = PageIO::HeaderPage::get_free_pagenum(&header_page);
-    if (free_pagenum == 0)
+    page_t header;
+    PageIO::HeaderPage::set_num_pages(&header, INITIAL_FREE_PAGES + 1);
+    PageIO::HeaderPage::set_free_pagenum(&header, 0);
+    PageIO::HeaderPage::set_high_water_mark(&header, 1);
+    PageIO::HeaderPage::set_page_size(&header, PAGE_SIZE);
+    file_write_page(fd, 0, &header);
+    FileIO::sync(fd);
+
+    return fd;
+}
+
+// Pages changed here bypass the buffer, so they are stamped like a
+// buffered write back; a stale checksum would fail the next buffered read
+static void file_write_stamped_page(int64_t table_id, pagenum_t page_number, page_t* page)
+{
+    PageIO::Checksum::stamp(page);
+    file_write_page(table_id, page_number, page);
+}
+
+// Open existing tablespace file or create one if not existed.
+// A tablespace shares one free page list among several B+ trees,
+// and keeps each tree's root in the catalog page.
+int64_t file_open_tablespace_file(const char* pathname)
+{
+    int64_t fd = file_open_table_file(pathname);
+    if (fd < 0) return -1;
+
+    page_t header;
+    file_read_page(fd, 0, &header);
+    if (PageIO::HeaderPage::get_catalog_pagenum(&header) == 0)
     {
-        pagenum_t next_num = PageIO::HeaderPage::get_num_pages(&header_page);
-        pagenum_t next_size = next_num * 2;
-        while (next_num < next_size)
+        if (PageIO::HeaderPage::get_root_pagenum(&header) != 0)
         {
-            page_t free_page;
-            PageIO::FreePage::set_next_free_pagenum(&free_page, free_pagenum);
-            free_pagenum = next_num;
-            FileIO::write(table_id, &free_page, PAGE_SIZE, next_num * PAGE_SIZE);
-            next_num++;
+            // Already in use as a single table file
+            return -1;
         }
-        PageIO::HeaderPage::set_free_pagenum(&header_page, free_pagenum);
-        PageIO::HeaderPage::set_num_pages(&header_page, next_size);
+        pagenum_t catalog_pagenum = file_alloc_page(fd);
+        page_t catalog;
+        PageIO::CatalogPage::set_num_entries(&catalog, 0);
+        file_write_stamped_page(fd, catalog_pagenum, &catalog);
+
+        file_read_page(fd, 0, &header);
+        PageIO::HeaderPage::set_catalog_pagenum(&header, catalog_pagenum);
+        file_write_stamped_page(fd, 0, &header);
     }
-    page_t free_page;
-    FileIO::read(table_id, &free_page, PAGE_SIZE, free_pagenum * PAGE_SIZE);
+    return fd;
+}
 
-    PageIO::HeaderPage::set_free_pagenum(&header_page, PageIO::FreePage::get_next_free_pagenum(&free_page));
-    FileIO::write(table_id, &header_page, PAGE_SIZE, 0);
+// Take a page from the free page list, or carve a never-used page off
+// the high-water mark. Doubles the file when every page is in use.
+// Only the header page image is modified; the caller writes it back.
+pagenum_t file_alloc_from_header(int64_t table_id, page_t* header_page)
+{
+    pagenum_t free_pagenum = PageIO::HeaderPage::get_free_pagenum(header_page);
+    if (free_pagenum != 0)
+    {
+        page_t free_page;
+        file_read_page(table_id, free_pagenum, &free_page);
+        PageIO::HeaderPage::set_free_pagenum(header_page, PageIO::FreePage::get_next_free_pagenum(&free_page));
+        return free_pagenum;
+    }
+
+    uint64_t num_pages = PageIO::HeaderPage::get_num_pages(header_page);
+    pagenum_t high_water_mark = PageIO::HeaderPage::get_high_water_mark(header_page);
+    if (high_water_mark == 0)
+    {
+        // File created without a high-water mark: every page was linked
+        high_water_mark = num_pages;
+    }
+    if (high_water_mark == num_pages)
+    {
+        num_pages *= 2;
+        // Compressed files grow one extent at a time instead
+        if (!Compress::is_compressed(table_id)) FileIO::allocate(table_id, num_pages * PAGE_SIZE);
+        PageIO::HeaderPage::set_num_pages(header_page, num_pages);
+    }
+    PageIO::HeaderPage::set_high_water_mark(header_page, high_water_mark + 1);
+    return high_water_mark;
+}
+
+// Allocate an on-disk page from the free page list
+pagenum_t file_alloc_page(int64_t table_id)
+{
+    page_t header_page;
+    file_read_page(table_id, 0, &header_page);
+
+    pagenum_t free_pagenum = file_alloc_from_header(table_id, &header_page);
+    file_write_stamped_page(table_id, 0, &header_page);
 
-    
     sync();
 
     return free_pagenum;
@@ -92,28 +237,42 @@ pagenum_t file_alloc_page(int64_t table_id)
 void file_free_page(int64_t table_id, pagenum_t page_number)
 {
     page_t header_page;
-    FileIO::read(table_id, &header_page, PAGE_SIZE, 0);
+    file_read_page(table_id, 0, &header_page);
 
     page_t free_page;
     PageIO::FreePage::set_next_free_pagenum(&free_page, PageIO::HeaderPage::get_free_pagenum(&header_page));
-    FileIO::write(table_id, &free_page, PAGE_SIZE, page_number * PAGE_SIZE);
+    file_write_stamped_page(table_id, page_number, &free_page);
 
     PageIO::HeaderPage::set_free_pagenum(&header_page, page_number);
-    FileIO::write(table_id, &header_page, PAGE_SIZE, 0);
+    file_write_stamped_page(table_id, 0, &header_page);
     
     sync();
 }
 
 // Read an on-disk page into the in-memory page structure(dest)
-void file_read_page(int64_t table_id, pagenum_t page_number, char* dest)
+bool file_read_page(int64_t table_id, pagenum_t page_number, char* dest)
 {
-    FileIO::read(table_id, dest, PAGE_SIZE, page_number * PAGE_SIZE);
-    
+    if (Compress::is_compressed(table_id)) return Compress::read_page(table_id, page_number, dest);
+    return FileIO::read(table_id, dest, PAGE_SIZE, page_number * PAGE_SIZE);
+}
+
+// Start reading an on-disk page in the background
+// Compressed pages are located through their map, so they are not prefetched
+void file_prefetch_page(int64_t table_id, pagenum_t page_number)
+{
+    if (Compress::is_compressed(table_id)) return;
+    FileIO::prefetch(table_id, PAGE_SIZE, page_number * PAGE_SIZE);
 }
 
 // Write an in-memory page(src) to the on-disk page
 void file_write_page(int64_t table_id, pagenum_t page_number, const char* src)
 {
+    if (Compress::is_compressed(table_id))
+    {
+        Compress::write_page(table_id, page_number, src);
+        sync();
+        return;
+    }
     FileIO::write(table_id, src, PAGE_SIZE, page_number * PAGE_SIZE);
     sync();
 }
@@ -121,6 +280,7 @@ void file_write_page(int64_t table_id, pagenum_t page_number, const char* src)
 // Stop referencing the database file
 void file_close_database_file()
 {
+    Compress::detach_all();
     for (auto const& fd : FileIO::opened_files)
     {
         FileIO::close(fd);
@@ -131,8 +291,8 @@ void file_close_database_file()
 
 
 // Read an on-disk page into the in-memory page structure(dest)
-void file_read_page(int64_t table_id, pagenum_t page_number, page_t* dest){
-    file_read_page(table_id, page_number, reinterpret_cast<char*>(dest));
+bool file_read_page(int64_t table_id, pagenum_t page_number, page_t* dest){
+    return file_read_page(table_id, page_number, reinterpret_cast<char*>(dest));
 }
 
 // Write an in-memory page(src) to the on-disk page
@@ -1,82 +1,256 @@
 #include "lock_table.h"
 #include "trx.h"
+#include <algorithm>
 #include <set>
 #define DEBUG_MODE 0
 
-pthread_mutex_t lock_table_latch;
+lock_table_partition_t lock_table[LOCK_TABLE_PARTITIONS];
 
-std::unordered_map<std::pair<int64_t, int64_t>, hash_table_entry_t*, Hash> lock_table;
+lock_table_partition_t* get_partition(int64_t table_id, int64_t page_id) {
+	return &lock_table[Hash()({ table_id, page_id }) % LOCK_TABLE_PARTITIONS];
+}
 
-void wake_up(hash_table_entry_t* list, lock_t* lock) {
-	lock_t* cur = list->head;
-	int record_id = lock->record_id;
-	int trx_id = lock->trx_id;
-	int x = 0;
-	int y = 0;
-	while (cur != nullptr) {
-		if ((cur->bitmap & lock->bitmap) == 0 || cur->trx_id == lock->trx_id) {
-			cur = cur->next;
-			continue;
+pthread_mutex_t* get_entry_latch(hash_table_entry_t* list) {
+	return &list->partition->latch;
+}
+
+// Helpers below are called with the partition latch held
+
+static hash_table_entry_t** get_bucket(lock_table_partition_t* partition, int64_t table_id, int64_t page_id) {
+	size_t h = Hash()({ table_id, page_id }) / LOCK_TABLE_PARTITIONS;
+	return &partition->buckets[h % LOCK_TABLE_BUCKETS];
+}
+
+hash_table_entry_t* find_entry(lock_table_partition_t* partition, int64_t table_id, int64_t page_id) {
+	hash_table_entry_t* list = *get_bucket(partition, table_id, page_id);
+	while (list != nullptr && (list->table_id != table_id || list->page_id != page_id)) {
+		list = list->hash_next;
+	}
+	return list;
+}
+
+static bool fast_slots_free(hash_table_entry_t* list) {
+	for (int s = 0; s < FAST_SLOTS; s++) {
+		if (list->fast_owner[s].load() != 0) return false;
+	}
+	return true;
+}
+
+// Returns idle entries (no queue, no fast slots) to the free list
+static void reclaim_idle_entries(lock_table_partition_t* partition) {
+	for (int b = 0; b < LOCK_TABLE_BUCKETS; b++) {
+		hash_table_entry_t** cur = &partition->buckets[b];
+		while (*cur != nullptr) {
+			hash_table_entry_t* list = *cur;
+			if (list->head == nullptr) {
+				// Block new fast slots before checking for existing ones
+				uint64_t header = list->fast_header.fetch_or(FAST_HEADER_SLOW);
+				if (fast_slots_free(list)) {
+					free_entry(list);
+					continue;
+				}
+				if (!(header & FAST_HEADER_SLOW)) list->fast_header.fetch_and(~FAST_HEADER_SLOW);
+			}
+			cur = &list->hash_next;
 		}
-		if (cur->lock_mode == LOCK_MODE_EXCLUSIVE) {
-			if (x == 0 || (y == 0 && x == cur->trx_id)) {
-				#if DEBUG_MODE
-				std::cout << "[DEBUG] wake up trx_id: " << cur->trx_id << std::endl;
-				#endif
-				pthread_cond_signal(&cur->lock_table_cond);
+	}
+}
+
+hash_table_entry_t* alloc_entry(lock_table_partition_t* partition, int64_t table_id, int64_t page_id) {
+	if (partition->free_entries == nullptr) {
+		reclaim_idle_entries(partition);
+	}
+	if (partition->free_entries == nullptr) {
+		hash_table_entry_t* slab = new hash_table_entry_t[LOCK_SLAB_SIZE];
+		for (int i = 0; i < LOCK_SLAB_SIZE; i++) {
+			slab[i].fast_header = FAST_HEADER_SLOW;
+			for (int s = 0; s < FAST_SLOTS; s++) {
+				slab[i].fast_owner[s] = 0;
+				for (int w = 0; w < FAST_BITMAP_WORDS; w++) slab[i].fast_bits[s][w] = 0;
 			}
-			break;
-		} else {
-			if (x == 0) x = cur->trx_id;
-			else if (cur->trx_id != x) y = cur->trx_id;
+			slab[i].hash_next = partition->free_entries;
+			partition->free_entries = &slab[i];
+		}
+		partition->entry_slabs.push_back(slab);
+	}
+	hash_table_entry_t* list = partition->free_entries;
+	partition->free_entries = list->hash_next;
+
+	// Still marked slow, so latch-free readers ignore it until it is idle
+	__atomic_store_n(&list->table_id, table_id, __ATOMIC_RELAXED);
+	__atomic_store_n(&list->page_id, page_id, __ATOMIC_RELAXED);
+	list->head = nullptr;
+	list->tail = nullptr;
+	list->partition = partition;
+
+	hash_table_entry_t** bucket = get_bucket(partition, table_id, page_id);
+	__atomic_store_n(&list->hash_next, *bucket, __ATOMIC_RELAXED);
+	__atomic_store_n(bucket, list, __ATOMIC_RELEASE);
+	return list;
+}
+
+// Unlinks an idle entry and recycles it. The new generation makes
+// latch-free readers that still hold a pointer to it fail validation.
+void free_entry(hash_table_entry_t* list) {
+	lock_table_partition_t* partition = list->partition;
+	hash_table_entry_t** cur = get_bucket(partition, list->table_id, list->page_id);
+	while (*cur != list) {
+		cur = &(*cur)->hash_next;
+	}
+	__atomic_store_n(cur, list->hash_next, __ATOMIC_RELEASE);
+
+	uint64_t generation = (list->fast_header.load() >> 1) + 1;
+	list->fast_header = (generation << 1) | FAST_HEADER_SLOW;
+
+	__atomic_store_n(&list->hash_next, partition->free_entries, __ATOMIC_RELEASE);
+	partition->free_entries = list;
+}
+
+// Turns every claimed fast slot into an explicit S lock at the head of the
+// queue; they were granted before anything else could be queued. Slots
+// claimed after the slow flag is set are given back by their owners.
+static void convert_fast_locks(hash_table_entry_t* list) {
+	list->fast_header.fetch_or(FAST_HEADER_SLOW);
+	for (int s = 0; s < FAST_SLOTS; s++) {
+		uint64_t owner = list->fast_owner[s].load();
+		if (owner == 0 || (owner & FAST_SLOT_CONVERTED)) continue;
+
+		lock_t* lock = alloc_lock(list->partition);
+		lock->bitmap.reset();
+		for (uint64_t k = 0; k < LEAF_MAX_SLOTS; k++) {
+			if (list->fast_bits[s][k / 64].load() & (1ULL << (k % 64))) lock->bitmap.set(k);
+		}
+		if (!list->fast_owner[s].compare_exchange_strong(owner, owner | FAST_SLOT_CONVERTED)) {
+			free_lock(list->partition, lock);
+			continue;
+		}
+		lock->sentinel = list;
+		lock->lock_mode = LOCK_MODE_SHARED;
+		lock->record_id = 0;
+		lock->trx_next = nullptr;
+		lock->trx_id = (int)owner;
+		lock->wait_for = nullptr;
+		lock->original_value = nullptr;
+		lock->original_size = 0;
+		list->fast_lock[s] = lock;
+
+		lock->prev = nullptr;
+		lock->next = list->head;
+		if (list->head != nullptr) list->head->prev = lock;
+		list->head = lock;
+		if (list->tail == nullptr) list->tail = lock;
+	}
+}
+
+// Once the queue is empty and no slot is claimed, the fast path reopens
+static void reopen_fast_path(hash_table_entry_t* list) {
+	if (list->head == nullptr && fast_slots_free(list)) {
+		list->fast_header.fetch_and(~FAST_HEADER_SLOW);
+	}
+}
+
+lock_t* alloc_lock(lock_table_partition_t* partition) {
+	if (partition->free_locks == nullptr) {
+		lock_t* slab = new lock_t[LOCK_SLAB_SIZE];
+		for (int i = 0; i < LOCK_SLAB_SIZE; i++) {
+			pthread_cond_init(&slab[i].lock_table_cond, NULL);
+			slab[i].next = partition->free_locks;
+			partition->free_locks = &slab[i];
+		}
+		partition->lock_slabs.push_back(slab);
+	}
+	lock_t* lock = partition->free_locks;
+	partition->free_locks = lock->next;
+	return lock;
+}
+
+// The owner of a released lock is never waiting on its condition variable,
+// so the condition variable can be handed to the next owner as is
+void free_lock(lock_table_partition_t* partition, lock_t* lock) {
+	lock->next = partition->free_locks;
+	partition->free_locks = lock;
+}
+
+// Whether lock conflicts with a lock queued before it, ignoring released
+static bool conflicts_before(hash_table_entry_t* list, lock_t* lock, lock_t* released) {
+	for (lock_t* cur = list->head; cur != lock; cur = cur->next) {
+		if (cur == released || cur->trx_id == lock->trx_id) continue;
+		if ((cur->lock_mode | lock->lock_mode) == LOCK_MODE_EXCLUSIVE && (cur->bitmap & lock->bitmap).any()) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// A lock only waits for locks queued before it. Once lock is released,
+// every later lock on one of its records that no longer conflicts is woken;
+// with compressed locks that can be several X locks on different records.
+void wake_up(hash_table_entry_t* list, lock_t* lock) {
+	for (lock_t* cur = lock->next; cur != nullptr; cur = cur->next) {
+		if ((cur->bitmap & lock->bitmap).none() || cur->trx_id == lock->trx_id) continue;
+		if (!conflicts_before(list, cur, lock)) {
+			#if DEBUG_MODE
+			std::cout << "[DEBUG] wake up trx_id: " << cur->trx_id << std::endl;
+			#endif
 			pthread_cond_signal(&cur->lock_table_cond);
-			cur = cur->next;
 		}
 	}
 };
 
 
 int init_lock_table() {
-	// lock_table_latch = PTHREAD_MUTEX_INITIALIZER;
-	pthread_mutex_init(&lock_table_latch, NULL);
+	for (int i = 0; i < LOCK_TABLE_PARTITIONS; i++) {
+		lock_table_partition_t* partition = &lock_table[i];
+		pthread_mutex_init(&partition->latch, NULL);
+		std::fill(partition->buckets, partition->buckets + LOCK_TABLE_BUCKETS, nullptr);
+		partition->free_locks = nullptr;
+		partition->free_entries = nullptr;
+	}
 	return 0;
 }
 
 int shutdown_lock_table() { 
-	for(auto it = lock_table.begin(); it != lock_table.end();) {
-		hash_table_entry_t* list = it->second;
-		// ASSUME THE LIST IS EMPTY
-		delete list;
-		lock_table.erase(it++);
+	for (int i = 0; i < LOCK_TABLE_PARTITIONS; i++) {
+		lock_table_partition_t* partition = &lock_table[i];
+		// ASSUME EVERY LOCK IS RELEASED
+		for (lock_t* slab : partition->lock_slabs) {
+			for (int j = 0; j < LOCK_SLAB_SIZE; j++) {
+				pthread_cond_destroy(&slab[j].lock_table_cond);
+			}
+			delete[] slab;
+		}
+		for (hash_table_entry_t* slab : partition->entry_slabs) {
+			delete[] slab;
+		}
+		partition->lock_slabs.clear();
+		partition->entry_slabs.clear();
+		pthread_mutex_destroy(&partition->latch);
 	}
-	pthread_mutex_destroy(&lock_table_latch);
 	return 0;
 }
 
 lock_t* lock_acquire(int64_t table_id, pagenum_t page_id, int64_t key, int trx_id, int lock_mode) {
-	pthread_mutex_lock(&lock_table_latch);
-	std::pair<int64_t, int64_t> p(table_id, page_id);
-	hash_table_entry_t* list = lock_table[p];
+	lock_table_partition_t* partition = get_partition(table_id, page_id);
+	pthread_mutex_lock(&partition->latch);
+	hash_table_entry_t* list = find_entry(partition, table_id, page_id);
 	if (list == nullptr) {
-		list = new hash_table_entry_t();
-		list->table_id = table_id;
-		list->page_id = page_id;
-		list->head = nullptr;
-		list->tail = nullptr;
-		lock_table[p] = list;
+		list = alloc_entry(partition, table_id, page_id);
 	}
-	lock_t* lock = new lock_t();
+	convert_fast_locks(list);
+	lock_t* lock = alloc_lock(partition);
 
 	lock->next = nullptr;
 	lock->prev = list->tail;
 	lock->sentinel = list;
-	pthread_cond_init(&lock->lock_table_cond, NULL);
 	lock->lock_mode = lock_mode;
 	lock->record_id = key;
+	lock->trx_next = nullptr;
 	lock->trx_id = trx_id;
+	lock->wait_for = nullptr;
 	lock->original_value = nullptr;
 	lock->original_size = 0;
-	lock->bitmap = (((uint64_t)1) << key);
+	lock->bitmap.reset();
+	lock->bitmap.set(key);
 
 	if (list->tail != nullptr) {
 		list->tail->next = lock;
@@ -86,15 +260,16 @@ lock_t* lock_acquire(int64_t table_id, pagenum_t page_id, int64_t key, int trx_i
 		list->head = lock;
 	}
 	
-	pthread_mutex_unlock(&lock_table_latch);
+	pthread_mutex_unlock(&partition->latch);
 	return lock;
 };
 
 int lock_release(lock_t* lock_obj) {
-	pthread_mutex_lock(&lock_table_latch);
+	hash_table_entry_t* list = lock_obj->sentinel;
+	pthread_mutex_t* latch = get_entry_latch(list);
+	pthread_mutex_lock(latch);
 	lock_t* prev = lock_obj->prev;
 	lock_t* next = lock_obj->next;
-	hash_table_entry_t* list = lock_obj->sentinel;
 
 	wake_up(list, lock_obj);
 	
@@ -111,50 +286,150 @@ int lock_release(lock_t* lock_obj) {
 		list->tail = prev;
 	}
 
-	pthread_cond_destroy(&lock_obj->lock_table_cond);
-
-	delete lock_obj;
+	free_lock(list->partition, lock_obj);
+	reopen_fast_path(list);
 	
-	pthread_mutex_unlock(&lock_table_latch);
+	pthread_mutex_unlock(latch);
 	return 0;
 }
 
-bool lock_exist(int64_t table_id, int64_t page_id, int64_t key, int trx_id){
-	pthread_mutex_lock(&lock_table_latch);
-	std::pair<int64_t, int64_t> p(table_id, page_id);
-	hash_table_entry_t* list = lock_table[p];
+bool lock_exist(int64_t table_id, int64_t page_id, int64_t key){
+	lock_table_partition_t* partition = get_partition(table_id, page_id);
+	pthread_mutex_lock(&partition->latch);
+	hash_table_entry_t* list = find_entry(partition, table_id, page_id);
 	if (list == nullptr) {
-		pthread_mutex_unlock(&lock_table_latch);
+		pthread_mutex_unlock(&partition->latch);
 		return false;
 	}
 	lock_t* cur = list->head;
 	while (cur != nullptr) {
-		if ((cur->bitmap & (((uint64_t)1) << key)) > 0 /* && cur->trx_id != trx_id */) {
-			pthread_mutex_unlock(&lock_table_latch);
+		if (cur->bitmap.test(key)) {
+			pthread_mutex_unlock(&partition->latch);
 			return true;
 		}
 		cur = cur->next;
 	}
-	pthread_mutex_unlock(&lock_table_latch);
+	for (int s = 0; s < FAST_SLOTS; s++) {
+		if (list->fast_owner[s].load() != 0 && (list->fast_bits[s][key / 64].load() & (1ULL << (key % 64)))) {
+			pthread_mutex_unlock(&partition->latch);
+			return true;
+		}
+	}
+	pthread_mutex_unlock(&partition->latch);
+	return false;
+}
+
+// Latch-free lookup. The entry may be recycled by free_entry at any time,
+// even for another page. Its memory stays in the slab, so reading it is
+// safe, but callers must take fast_header first and check it again after
+// claiming: free_entry bumps the generation, which is what catches reuse.
+static hash_table_entry_t* find_entry_latch_free(int64_t table_id, int64_t page_id) {
+	lock_table_partition_t* partition = get_partition(table_id, page_id);
+	hash_table_entry_t* list = __atomic_load_n(get_bucket(partition, table_id, page_id), __ATOMIC_ACQUIRE);
+	for (int steps = 0; list != nullptr && steps < LOCK_SLAB_SIZE; steps++) {
+		if (__atomic_load_n(&list->table_id, __ATOMIC_RELAXED) == table_id &&
+			__atomic_load_n(&list->page_id, __ATOMIC_RELAXED) == page_id) {
+			return list;
+		}
+		list = __atomic_load_n(&list->hash_next, __ATOMIC_ACQUIRE);
+	}
+	return nullptr;
+}
+
+/* Grants an S lock without latching if no one has queued a lock on the page
+ * since it was last idle. Costs one CAS for the first record of a page and
+ * none for the next ones. The caller holds the page latch and has checked
+ * that no implicit X lock covers the record. Returns false if the regular
+ * path has to be taken.
+ */
+bool lock_acquire_fast(int64_t table_id, pagenum_t page_id, int64_t key, int trx_id, std::vector<fast_lock_ref_t>& fast_locks) {
+	hash_table_entry_t* list = find_entry_latch_free(table_id, page_id);
+	if (list == nullptr) {
+		// First lock on the page: create an idle entry once
+		lock_table_partition_t* partition = get_partition(table_id, page_id);
+		pthread_mutex_lock(&partition->latch);
+		list = find_entry(partition, table_id, page_id);
+		if (list == nullptr) {
+			list = alloc_entry(partition, table_id, page_id);
+			reopen_fast_path(list);
+		}
+		pthread_mutex_unlock(&partition->latch);
+	}
+
+	uint64_t header = list->fast_header.load();
+	if (header & FAST_HEADER_SLOW) return false;
+	if (__atomic_load_n(&list->table_id, __ATOMIC_RELAXED) != table_id ||
+		__atomic_load_n(&list->page_id, __ATOMIC_RELAXED) != (int64_t)page_id) {
+		return false;
+	}
+
+	int slot = -1;
+	for (int s = 0; s < FAST_SLOTS; s++) {
+		if (list->fast_owner[s].load() == (uint64_t)trx_id) {
+			slot = s;
+			break;
+		}
+	}
+	bool claimed = false;
+	for (int s = 0; slot < 0 && s < FAST_SLOTS; s++) {
+		uint64_t expected = 0;
+		if (list->fast_owner[s].compare_exchange_strong(expected, (uint64_t)trx_id)) {
+			slot = s;
+			claimed = true;
+			fast_locks.push_back({ list, s });
+		}
+	}
+	if (slot < 0) return false;
+
+	list->fast_bits[slot][key / 64].fetch_or(1ULL << (key % 64));
+
+	// Pairs with convert_fast_locks: either it saw our bit, or we see the flag
+	if (list->fast_header.load() == header) return true;
+
+	if (claimed) {
+		for (int w = 0; w < FAST_BITMAP_WORDS; w++) list->fast_bits[slot][w] = 0;
+		uint64_t expected = trx_id;
+		if (list->fast_owner[slot].compare_exchange_strong(expected, 0)) {
+			fast_locks.pop_back();
+		}
+		// else it was converted and is released with the others at commit
+	}
 	return false;
 }
 
+void lock_release_fast(const fast_lock_ref_t& ref, int trx_id) {
+	hash_table_entry_t* list = ref.entry;
+	for (int w = 0; w < FAST_BITMAP_WORDS; w++) list->fast_bits[ref.slot][w] = 0;
+
+	uint64_t expected = trx_id;
+	if (list->fast_owner[ref.slot].compare_exchange_strong(expected, 0)) return;
+
+	// Converted: release the explicit lock the slot became
+	pthread_mutex_t* latch = get_entry_latch(list);
+	pthread_mutex_lock(latch);
+	lock_t* lock = list->fast_lock[ref.slot];
+	list->fast_owner[ref.slot] = 0;
+	pthread_mutex_unlock(latch);
+	lock_release(lock);
+}
+
 lock_t* lock_acquire_compressed(int64_t table_id, pagenum_t page_id, int64_t key, int trx_id) {
-	pthread_mutex_lock(&lock_table_latch);
+	lock_table_partition_t* partition = get_partition(table_id, page_id);
+	pthread_mutex_lock(&partition->latch);
 
-	std::pair<int64_t, int64_t> p(table_id, page_id);
-	hash_table_entry_t* list = lock_table[p];
+	hash_table_entry_t* list = find_entry(partition, table_id, page_id);
 
 	if (list == nullptr) {
-		pthread_mutex_unlock(&lock_table_latch);
+		pthread_mutex_unlock(&partition->latch);
 		return nullptr;
 	}
 
 	lock_t* cur = list->head;
 	while (cur != nullptr) {
 		// No X lock holding this key exist in the trx (guarenteed by the caller function)
-		if(cur->lock_mode == LOCK_MODE_EXCLUSIVE && (cur->bitmap & (((uint64_t)1) << key)) != 0){
-			pthread_mutex_unlock(&lock_table_latch);
+		// Any other X lock, granted or waiting, makes this a regular request
+		if(cur->lock_mode == LOCK_MODE_EXCLUSIVE && cur->bitmap.test(key)){
+			pthread_mutex_unlock(&partition->latch);
 			return nullptr;
 		}
 		cur = cur->next;
@@ -171,10 +446,10 @@ lock_t* lock_acquire_compressed(int64_t table_id, pagenum_t page_id, int64_t key
 	}
 
 	if(me != nullptr){
-		me->bitmap |= (((uint64_t)1) << key);
+		me->bitmap.set(key);
 	}
 
 
-	pthread_mutex_unlock(&lock_table_latch);
+	pthread_mutex_unlock(&partition->latch);
 	return me;
 }
\ No newline at end of file
@@ -8,17 +8,19 @@
 
 // Find Operations
 
-/* Finds the leaf node's pagenum containing given key. */
+/* Finds the leaf node's pagenum containing given key.
+ * PAGENUM_CORRUPTED if a page on the way failed its checksum.
+ */
 pagenum_t find_leaf(int64_t table_id, pagenum_t root_pagenum, int64_t key) {
     pagenum_t cur = root_pagenum;
 
-    if (cur == 0) {
+    if (cur == 0 || cur == PAGENUM_CORRUPTED) {
         return cur;
     }
 
     control_block_t* ctrl_block = buf_read_page(table_id, cur);
 
-    while (PageIO::BPT::get_is_leaf(ctrl_block->frame) == 0) // While the page is internal
+    while (!ctrl_block->corrupted && PageIO::BPT::get_is_leaf(ctrl_block->frame) == 0) // While the page is internal
     {
         int num_keys = PageIO::BPT::get_num_keys(ctrl_block->frame);
         int i = num_keys;
@@ -46,6 +48,7 @@ pagenum_t find_leaf(int64_t table_id, pagenum_t root_pagenum, int64_t key) {
         ctrl_block = buf_read_page(table_id, cur);
         // file_read_page(table_id, cur, &page);
     }
+    if (ctrl_block->corrupted) cur = PAGENUM_CORRUPTED;
     buf_return_ctrl_block(&ctrl_block);
     return cur;
 }
@@ -57,6 +60,7 @@ int find(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* ret_val, u
     * val_size = 0;
     pagenum_t leaf = find_leaf(table_id, root_pagenum, key);
 
+    if (leaf == PAGENUM_CORRUPTED) return -1;
     if (leaf == 0) return 1;
 
     control_block_t* ctrl_block = buf_read_page(table_id, leaf);
@@ -91,14 +95,18 @@ int find(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* ret_val, u
     }
 
 
-    if (trx_id > 0) {
+    // Fast path: no implicit X lock on the record and no one queued on the page
+    int trx_written = slot.get_trx_id();
+    trx_entry_t* trx = trx_id > 0 ? trx_get_entry(trx_id) : nullptr;
+    bool granted = trx != nullptr && (trx_written == 0 || trx_written == trx_id || !trx_maybe_active(trx_written)) &&
+        lock_acquire_fast(table_id, leaf, i, trx_id, trx->fast_locks);
+
+    if (trx_id > 0 && !granted) {
         // buf_return_ctrl_block(&ctrl_block);
 
-        if (!lock_exist(table_id, leaf, i, trx_id)) {
+        if (!lock_exist(table_id, leaf, i)) {
             // ctrl_block = buf_read_page(table_id, leaf);
-            int trx_written = slot.get_trx_id();
-
-            trx_implicit_to_explicit(table_id, leaf, i, trx_id, trx_written);
+            trx_implicit_to_explicit(table_id, leaf, i, trx_written);
         }
 
 
@@ -1206,22 +1214,38 @@ pagenum_t _delete(int64_t table_id, pagenum_t root_pagenum, int64_t key) {
 // API
 namespace Util {
     std::set<std::string> opened_tables;
+    std::map<std::string, int64_t> opened_tablespaces;
+
+    int64_t parse_table_id(char* pathname) {
+        std::string table_name(pathname);
+        std::string id = table_name.substr(4);
+        return std::stoi(id);
+    }
 }
 
 const std::regex TABLE_NAME_REGEX("^DATA[0-9]+$");
 
 int64_t open_table(char* pathname) {
-    std::string table_name(pathname);
-    // if (!std::regex_match(table_name, TABLE_NAME_REGEX)) {
+    return open_table(pathname, false);
+}
+
+/* Opens a table; if the file does not exist yet and compressed is set,
+ * it is created in the compressed format. Existing files are opened in
+ * whichever format they were created with.
+ */
+int64_t open_table(char* pathname, bool compressed) {
+    // if (!std::regex_match(std::string(pathname), TABLE_NAME_REGEX)) {
     //     return -1;
     // }
 
-    std::string id = table_name.substr(4);
-    int64_t table_id = std::stoi(id);
+    int64_t table_id = Util::parse_table_id(pathname);
 
     if (Util::opened_tables.find(std::string(pathname)) != Util::opened_tables.end()) {
         return table_id;
     }
+    if (buf_is_table_open(table_id)) { // Already opened inside a tablespace
+        return table_id;
+    }
     if (Util::opened_tables.size() == 19) { // Total number of tables is less than 20
         return -1;
     }
@@ -1229,7 +1253,7 @@ int64_t open_table(char* pathname) {
 
     std::cout << "[DEBUG] table_id == " << table_id << std::endl;
 
-    buf_open_table_file(pathname, table_id);
+    if (buf_open_table_file(pathname, table_id, compressed) < 0) return -1;
 
     if (table_id < 0) return -1;
 
@@ -1238,58 +1262,89 @@ int64_t open_table(char* pathname) {
     return table_id;
 }
 
-int db_insert(int64_t table_id, int64_t key, char* value, uint16_t val_size) {
-    control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
+/* Opens a tablespace file shared by several tables.
+ * Tables already in its catalog become accessible by their table_id,
+ * so open tablespaces before init_db() if recovery needs them.
+ */
+int64_t open_tablespace(char* pathname) {
+    auto it = Util::opened_tablespaces.find(std::string(pathname));
+    if (it != Util::opened_tablespaces.end()) {
+        return it->second;
+    }
+
+    int64_t tablespace_id = buf_open_tablespace_file(pathname);
+    if (tablespace_id < 0) return -1;
+
+    Util::opened_tablespaces[std::string(pathname)] = tablespace_id;
+    return tablespace_id;
+}
 
-    pagenum_t root_pagenum = PageIO::HeaderPage::get_root_pagenum(header_ctrl_block->frame);
-    buf_return_ctrl_block(&header_ctrl_block);
+/* Opens (or creates) table named pathname inside the tablespace.
+ */
+int64_t open_table_in_tablespace(int64_t tablespace_id, char* pathname) {
+    int64_t table_id = Util::parse_table_id(pathname);
+    if (Util::opened_tables.find(std::string(pathname)) != Util::opened_tables.end()) {
+        return -1; // Already opened as a single table file
+    }
+    return buf_open_table_in_tablespace(tablespace_id, table_id);
+}
+
+// Inserts and deletes are logged as a whole, see smo_begin
+int db_insert(int64_t table_id, int64_t key, char* value, uint16_t val_size) {
+    smo_begin();
+    pagenum_t root_pagenum = buf_get_root_pagenum(table_id);
 
     char buffer[MAX_VAL_SIZE];
     uint16_t size;
-    if (find(table_id, root_pagenum, key, buffer, &size) == 0) {
-        return -1;
+    if (find(table_id, root_pagenum, key, buffer, &size) != 1) {
+        smo_end();
+        return -1; // Duplicate, or a corrupted page on the way
     }
     root_pagenum = insert(table_id, root_pagenum, key, value, val_size);
 
-    header_ctrl_block = buf_read_page(table_id, 0);
-    PageIO::HeaderPage::set_root_pagenum(header_ctrl_block->frame, root_pagenum);
-    buf_return_ctrl_block(&header_ctrl_block, 1);
+    buf_set_root_pagenum(table_id, root_pagenum);
+    smo_end();
 
     return 0;
 }
 
 int db_find(int64_t table_id, int64_t key, char* ret_val, uint16_t* val_size) {
-    control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
-    pagenum_t root_pagenum = PageIO::HeaderPage::get_root_pagenum(header_ctrl_block->frame);
-    buf_return_ctrl_block(&header_ctrl_block);
-    return find(table_id, root_pagenum, key, ret_val, val_size);
+    smo_shared_begin();
+    pagenum_t root_pagenum = buf_get_root_pagenum(table_id);
+    int res = find(table_id, root_pagenum, key, ret_val, val_size);
+    smo_shared_end();
+    return res;
 }
 
 int db_delete(int64_t table_id, int64_t key) {
-    control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
-    pagenum_t root_pagenum = PageIO::HeaderPage::get_root_pagenum(header_ctrl_block->frame);
-    buf_return_ctrl_block(&header_ctrl_block);
+    smo_begin();
+    pagenum_t root_pagenum = buf_get_root_pagenum(table_id);
     root_pagenum = _delete(table_id, root_pagenum, key);
 
-    if (root_pagenum < 0) return -1;
+    if (root_pagenum == (pagenum_t)-1) {
+        smo_end();
+        return -1;
+    }
 
-    header_ctrl_block = buf_read_page(table_id, 0);
-    PageIO::HeaderPage::set_root_pagenum(header_ctrl_block->frame, root_pagenum);
-    buf_return_ctrl_block(&header_ctrl_block, 1);
+    buf_set_root_pagenum(table_id, root_pagenum);
+    smo_end();
     return 0;
 }
 
-int init_db(int num_buf) {
+int init_db(int num_buf, int deadlock_policy) {
     if (num_buf < 3) num_buf = 3;
     int err = 0;
     err += buf_init_db(num_buf);
     err += init_lock_table();
-    err += trx_init();
+    err += trx_init(deadlock_policy);
     return 0;
 }
 
 int shutdown_db() {
+    // Stops the checkpointer and makes the log durable before pages go out
+    shutdown_recovery();
     Util::opened_tables.clear();
+    Util::opened_tablespaces.clear();
     buf_shutdown_db();
     shutdown_lock_table();
     trx_shutdown();
@@ -1335,15 +1390,14 @@ int acquire_lock(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, i
     lock_t* lock = trx_get_lock(table_id, pagenum, key, trx_id, lock_mode);
 
     if (lock == nullptr) {
-        // Lock compression // This does not work correctly
-        // TODO: Debug
-        // if(lock_mode == 0){
-        //     lock = lock_acquire_compressed(table_id, pagenum, key, trx_id);
-        //     if(lock != nullptr){
-        //         trx_add_to_locks(trx_id, key, lock);
-        //         return 0;
-        //     }
-        // }
+        // Lock compression: reuse the trx's S lock on this page
+        if (lock_mode == LOCK_MODE_SHARED) {
+            lock = lock_acquire_compressed(table_id, pagenum, key, trx_id);
+            if (lock != nullptr) {
+                trx_add_to_locks(trx_id, key, lock);
+                return 0;
+            }
+        }
         lock = lock_acquire(table_id, pagenum, key, trx_id, lock_mode);
         int res = trx_acquire(trx_id, lock);
         return res;
@@ -1354,12 +1408,12 @@ int acquire_lock(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, i
 int db_find(int64_t table_id, int64_t key, char* ret_val, uint16_t* val_size, int trx_id) {
     int err = 2;
     while (err == 2) {
-        control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
-        pagenum_t root_pagenum = PageIO::HeaderPage::get_root_pagenum(header_ctrl_block->frame);
-        buf_return_ctrl_block(&header_ctrl_block);
+        smo_shared_begin();
+        pagenum_t root_pagenum = buf_get_root_pagenum(table_id);
         err = find(table_id, root_pagenum, key, ret_val, val_size, trx_id);
-        if (err == 2) {
-            trx_sleep(trx_id);
+        smo_shared_end();
+        if (err == 2 && trx_sleep(trx_id)) {
+            err = -1;
         }
     }
 
@@ -1371,6 +1425,7 @@ int update(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* value, u
     pagenum_t leaf = find_leaf(table_id, root_pagenum, key);
 
     *old_val_size = 0;
+    if (leaf == PAGENUM_CORRUPTED) return -1;
     if (leaf == 0) return 1;
 
     control_block_t* ctrl_block = buf_read_page(table_id, leaf);
@@ -1399,7 +1454,7 @@ int update(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* value, u
         return 1;
     }
 
-    if (lock_exist(table_id, leaf, i, trx_id)) {
+    if (lock_exist(table_id, leaf, i)) {
         int res = acquire_lock(table_id, leaf, i, trx_id, 1);
         if (res == 1 || res == 2) {
             buf_return_ctrl_block(&ctrl_block);
@@ -1412,7 +1467,7 @@ int update(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* value, u
         // TODO: implicit locking
         int trx_written = slot.get_trx_id();
 
-        int res = trx_implicit_to_explicit(table_id, leaf, i, trx_id, trx_written);
+        int res = trx_implicit_to_explicit(table_id, leaf, i, trx_written);
 
         if (res) {
             // Implicit to Explicit Failed
@@ -1443,7 +1498,7 @@ int update(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* value, u
     ctrl_block->frame->get_data(log.second, slot.get_offset(), *old_val_size);
 
     // New Logging System
-    log_entry_t* log_ = create_update_log(trx_id, table_id, leaf, slot.get_offset(), slot.get_size(), const_cast<const char*>(log.second), const_cast<const char*>(value));
+    log_entry_t log_ = create_slot_update_log(trx_id, table_id, leaf, slot.get_key(), slot.get_offset(), slot.get_size(), const_cast<const char*>(log.second), const_cast<const char*>(value));
     uint64_t lsn = add_to_log_buffer(log_);
 
     if (!opt.has_value()) {
@@ -1460,12 +1515,12 @@ int update(int64_t table_id, pagenum_t root_pagenum, int64_t key, char* value, u
 int db_update(int64_t table_id, int64_t key, char* value, uint16_t val_size, uint16_t* old_val_size, int trx_id) {
     int err = 2;
     while (err == 2) {
-        control_block_t* header_ctrl_block = buf_read_page(table_id, 0);
-        pagenum_t root_pagenum = PageIO::HeaderPage::get_root_pagenum(header_ctrl_block->frame);
-        buf_return_ctrl_block(&header_ctrl_block);
+        smo_shared_begin();
+        pagenum_t root_pagenum = buf_get_root_pagenum(table_id);
         err = update(table_id, root_pagenum, key, value, val_size, old_val_size, trx_id);
-        if (err == 2) {
-            trx_sleep(trx_id);
+        smo_shared_end();
+        if (err == 2 && trx_sleep(trx_id)) {
+            err = -1;
         }
     }
 
@@ -1479,9 +1534,14 @@ int db_update(int64_t table_id, int64_t key, char* value, uint16_t val_size, uin
  *                                                                           *
  *****************************************************************************/
 
-int init_db(int num_buf, int flag, int log_num, char* log_path, char* logmsg_path) {
-    int res = init_db(num_buf); // DBMS initialization
-    init_recovery(log_path);
+int init_db(int num_buf, int flag, int log_num, char* log_path, char* logmsg_path, int deadlock_policy) {
+    int res = init_db(num_buf, deadlock_policy); // DBMS initialization
+    if (res != 0) return res;
+    if (init_recovery(log_path) != 0) {
+        std::cout << "[ERROR] Failed to open the log " << log_path << std::endl;
+        shutdown_db();
+        return -1;
+    }
     recover_main(logmsg_path, flag, log_num);
-    return res;
+    return 0;
 }
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include "page.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#endif
 #define DEBUG_MODE 0
 
 page_t::page_t() { std::fill_n(data, PAGE_SIZE, '\0'); };
@@ -78,6 +81,90 @@ void branch_factor_t::set_pagenum(pagenum_t pagenum) {
     std::memcpy(data + BF_PAGENUM_OFFSET, &pagenum, sizeof(pagenum));
 }
 
+namespace {
+    constexpr uint32_t CRC32C_POLY = 0x82F63B78; // reflected Castagnoli polynomial
+
+    struct crc32c_table_t {
+        uint32_t table[256];
+        crc32c_table_t() {
+            for (uint32_t i = 0; i < 256; i++) {
+                uint32_t crc = i;
+                for (int j = 0; j < 8; j++) {
+                    crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+                }
+                table[i] = crc;
+            }
+        }
+    };
+    const crc32c_table_t crc32c_table;
+
+    uint32_t crc32c_sw(uint32_t crc, const char* buf, size_t len) {
+        while (len--) {
+            crc = crc32c_table.table[(crc ^ (uint8_t)*buf++) & 0xff] ^ (crc >> 8);
+        }
+        return crc;
+    }
+
+    #if defined(__x86_64__) || defined(__i386__)
+    __attribute__((target("sse4.2")))
+    uint32_t crc32c_hw(uint32_t crc, const char* buf, size_t len) {
+        #if defined(__x86_64__)
+        uint64_t crc64 = crc;
+        for (; len >= 8; buf += 8, len -= 8) {
+            uint64_t word;
+            std::memcpy(&word, buf, sizeof(word));
+            crc64 = _mm_crc32_u64(crc64, word);
+        }
+        crc = (uint32_t)crc64;
+        #endif
+        for (; len > 0; buf++, len--) {
+            crc = _mm_crc32_u8(crc, (uint8_t)*buf);
+        }
+        return crc;
+    }
+
+    const bool has_sse42 = [] {
+        __builtin_cpu_init();
+        return __builtin_cpu_supports("sse4.2") != 0;
+    }();
+    #else
+    const bool has_sse42 = false;
+    uint32_t crc32c_hw(uint32_t crc, const char* buf, size_t len) { return crc32c_sw(crc, buf, len); }
+    #endif
+}
+
+uint32_t crc32c(uint32_t crc, const void* buf, size_t len) {
+    const char* p = reinterpret_cast<const char*>(buf);
+    return has_sse42 ? crc32c_hw(crc, p, len) : crc32c_sw(crc, p, len);
+}
+
+/* Checksum of the page with its checksum field taken as zero.
+ * Never returns 0, which marks a page that was not stamped.
+ */
+uint32_t PageIO::Checksum::compute(page_t* page) {
+    const char* data = reinterpret_cast<const char*>(page);
+    const uint32_t zero = 0;
+    uint32_t crc = ~0u;
+    crc = crc32c(crc, data, PAGE_CHECKSUM_OFFSET);
+    crc = crc32c(crc, &zero, sizeof(zero));
+    crc = crc32c(crc, data + PAGE_CHECKSUM_OFFSET + sizeof(zero), PAGE_SIZE - PAGE_CHECKSUM_OFFSET - sizeof(zero));
+    crc = ~crc;
+    return crc == 0 ? 1 : crc;
+}
+uint32_t PageIO::Checksum::get(page_t* page) {
+    return page->get_data<uint32_t>(PAGE_CHECKSUM_OFFSET);
+}
+void PageIO::Checksum::set(page_t* page, uint32_t checksum) {
+    page->set_data(checksum, PAGE_CHECKSUM_OFFSET);
+}
+void PageIO::Checksum::stamp(page_t* page) {
+    set(page, compute(page));
+}
+bool PageIO::Checksum::verify(page_t* page) {
+    uint32_t checksum = get(page);
+    return checksum == 0 || checksum == compute(page);
+}
+
 pagenum_t PageIO::HeaderPage::get_free_pagenum(page_t* page) {
     return page->get_data<pagenum_t>(HEADER_FREE_OFFSET);
 }
@@ -93,9 +180,47 @@ void PageIO::HeaderPage::set_free_pagenum(page_t* page, pagenum_t free_pagenum)
 void PageIO::HeaderPage::set_num_pages(page_t* page, uint64_t num_pages) {
     page->set_data(num_pages, HEADER_NUMPAGE_OFFSET);
 }
+pagenum_t PageIO::HeaderPage::get_catalog_pagenum(page_t* page) {
+    return page->get_data<pagenum_t>(HEADER_CATALOG_PAGENUM_OFFSET);
+}
+pagenum_t PageIO::HeaderPage::get_high_water_mark(page_t* page) {
+    return page->get_data<pagenum_t>(HEADER_HIGH_WATER_MARK_OFFSET);
+}
+uint64_t PageIO::HeaderPage::get_page_size(page_t* page) {
+    uint64_t page_size = page->get_data<uint64_t>(HEADER_PAGE_SIZE_OFFSET);
+    return page_size == 0 ? LEGACY_PAGE_SIZE : page_size;
+}
 void PageIO::HeaderPage::set_root_pagenum(page_t* page, pagenum_t root_pagenum) {
     page->set_data(root_pagenum, HEADER_ROOT_PAGENUM_OFFSET);
 }
+void PageIO::HeaderPage::set_catalog_pagenum(page_t* page, pagenum_t catalog_pagenum) {
+    page->set_data(catalog_pagenum, HEADER_CATALOG_PAGENUM_OFFSET);
+}
+void PageIO::HeaderPage::set_high_water_mark(page_t* page, pagenum_t high_water_mark) {
+    page->set_data(high_water_mark, HEADER_HIGH_WATER_MARK_OFFSET);
+}
+void PageIO::HeaderPage::set_page_size(page_t* page, uint64_t page_size) {
+    page->set_data(page_size, HEADER_PAGE_SIZE_OFFSET);
+}
+
+int PageIO::CatalogPage::get_num_entries(page_t* page) {
+    return page->get_data<int>(CATALOG_NUM_ENTRIES_OFFSET);
+}
+int64_t PageIO::CatalogPage::get_nth_table_id(page_t* page, int n) {
+    return page->get_data<int64_t>(CATALOG_ENTRY_OFFSET + n * CATALOG_ENTRY_SIZE + CATALOG_ENTRY_TABLE_ID_OFFSET);
+}
+pagenum_t PageIO::CatalogPage::get_nth_root_pagenum(page_t* page, int n) {
+    return page->get_data<pagenum_t>(CATALOG_ENTRY_OFFSET + n * CATALOG_ENTRY_SIZE + CATALOG_ENTRY_ROOT_PAGENUM_OFFSET);
+}
+void PageIO::CatalogPage::set_num_entries(page_t* page, int num_entries) {
+    page->set_data(num_entries, CATALOG_NUM_ENTRIES_OFFSET);
+}
+void PageIO::CatalogPage::set_nth_table_id(page_t* page, int n, int64_t table_id) {
+    page->set_data(table_id, CATALOG_ENTRY_OFFSET + n * CATALOG_ENTRY_SIZE + CATALOG_ENTRY_TABLE_ID_OFFSET);
+}
+void PageIO::CatalogPage::set_nth_root_pagenum(page_t* page, int n, pagenum_t root_pagenum) {
+    page->set_data(root_pagenum, CATALOG_ENTRY_OFFSET + n * CATALOG_ENTRY_SIZE + CATALOG_ENTRY_ROOT_PAGENUM_OFFSET);
+}
 
 pagenum_t PageIO::FreePage::get_next_free_pagenum(page_t* page) {
     return page->get_data<pagenum_t>(FREE_FREE_OFFSET);
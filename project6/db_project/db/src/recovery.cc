@@ -3,32 +3,162 @@
 #include "buffer.h"
 #include "page.h"
 #include "trx.h"
+#include "compress.h"
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <map>
+#include <queue>
+#include <string>
+#include <fcntl.h>
+#include <sched.h>
+#include <cstdlib>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
-pthread_mutex_t log_buffer_mutex;
+// The log is a run of LOG_SEGMENT_SIZE files <log>.<n>, segment n holds
+// the LSNs [n * LOG_SEGMENT_SIZE, (n + 1) * LOG_SEGMENT_SIZE) at offset
+// lsn % LOG_SEGMENT_SIZE. Segments are allocated whole when created, and
+// ones behind the last checkpoint are renamed to come after the last
+// segment, so appends never change a file's size. A recycled segment
+// still holds old records, they are told apart by their LSNs.
+struct log_segment_t {
+    int fd;      // written by the log writer only
+    int read_fd; // for reading during recovery
+};
 
-FILE* log_file;
+// With LOG_COMPRESS, segments are cut into LOG_FRAME_SIZE frames by LSN
+// and each frame is stored compressed in its own slot, behind a header.
+// LSNs still count log bytes. The last frame is compressed and written
+// again on every flush, the way the tail block is otherwise.
+struct log_frame_header_t {
+    uint64_t lsn;           // of the frame's first byte, tells recycled slots apart
+    uint32_t length;        // log bytes in the frame
+    uint32_t stored_length;
+    uint16_t codec;
+};
+constexpr uint64_t LOG_FRAME_SLOT_SIZE = sizeof(log_frame_header_t) + LOG_FRAME_SIZE;
+constexpr uint64_t LOG_SEGMENT_FILE_SIZE = LOG_COMPRESS ? LOG_SEGMENT_SIZE / LOG_FRAME_SIZE * LOG_FRAME_SLOT_SIZE : LOG_SEGMENT_SIZE;
+// The writer writes the last unit again until it is full
+constexpr uint64_t LOG_WRITE_UNIT = LOG_COMPRESS ? LOG_FRAME_SIZE : LOG_BLOCK_SIZE;
 
-log_entry_t::log_entry_t() {
-    data = new char[LOG_ENTRY_SIZE];
-    memset(data, 0, LOG_ENTRY_SIZE);
-    *(int*)data = LOG_ENTRY_SIZE;
+std::string log_path_prefix;
+std::map<uint64_t, log_segment_t> log_segments;
+pthread_mutex_t log_segment_mutex = PTHREAD_MUTEX_INITIALIZER;
+bool log_opened = false;
+
+// Analysis and redo read the log through a read only mapping of the
+// segments as they were at startup, laid out next to each other so
+// records are used in place as views. Records run up to end, which
+// init_recovery finds.
+struct log_map_t {
+    char* base = nullptr; // at start_lsn
+    uint64_t start_lsn = 0;
+    uint64_t size = 0;
+    uint64_t end = 0;
+};
+log_map_t log_map;
+
+// The log buffer is a ring of LOG_RING_SIZE bytes, the record at lsn sits
+// at lsn % LOG_RING_SIZE. An appender reserves its bytes with a fetch_add
+// on next_lsn and copies its record in place, so appends don't serialize.
+// Copies are published in LSN order through copied_lsn, and the log writer
+// writes out [flushed_lsn, copied_lsn) with one write and one fdatasync.
+// Writes are whole blocks, the partial last one goes out zero padded
+// from log_tail_block and is written again by the next flush.
+alignas(LOG_BLOCK_SIZE) char log_ring[LOG_RING_SIZE];
+alignas(LOG_BLOCK_SIZE) char log_tail_block[LOG_BLOCK_SIZE];
+#if LOG_COMPRESS
+char log_frame[LOG_FRAME_SIZE]; // the writer's
+char log_frame_slot[LOG_FRAME_SLOT_SIZE];
+// Undo may read the frame the writer is rewriting
+pthread_mutex_t log_frame_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+std::atomic<uint64_t> next_lsn(0);
+std::atomic<uint64_t> copied_lsn(0);
+std::atomic<uint64_t> flushed_lsn(0);
+
+// Group commit: committers wait on log_flushed_cond for flushed_lsn to
+// pass their commit record, everything copied by then goes in one flush.
+// The mutex only guards sleeping and waking, never an append.
+pthread_mutex_t log_buffer_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t log_writer;
+pthread_cond_t log_writer_cond = PTHREAD_COND_INITIALIZER;
+pthread_cond_t log_flushed_cond = PTHREAD_COND_INITIALIZER;
+uint64_t flush_request_lsn = 0;
+bool log_writer_stop = false;
+
+// Master record, kept next to the log in <log>.master. It points analysis
+// at the last checkpoint and redo at the oldest change that may not be on
+// disk, and holds the transaction and dirty page tables the checkpoint saw.
+struct master_record_t {
+    uint64_t checkpoint_lsn = 0;
+    uint64_t redo_lsn = 0;
+    std::vector<att_entry_t> att;
+    std::vector<dpt_entry_t> dpt;
+};
+
+std::string master_path;
+master_record_t master_record;
+
+// A checkpoint is taken every LOG_CHECKPOINT_INTERVAL bytes of log
+pthread_mutex_t checkpoint_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_t checkpointer;
+pthread_cond_t checkpoint_cond = PTHREAD_COND_INITIALIZER;
+uint64_t checkpoint_lsn = 0; // guarded by log_buffer_mutex
+bool checkpointer_running = false;
+bool checkpointer_stop = false;
+
+// Undo pass left running by an instant restart
+pthread_t undo_thread;
+bool undo_running = false;
+
+static char* put_varint(char* dest, uint64_t value) {
+    while (value >= 0x80) {
+        *dest++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *dest++ = (char)value;
+    return dest;
 }
 
-log_entry_t::log_entry_t(int data_length, int compensate) {
-    int size = LOG_ENTRY_EXT_SIZE + 2 * data_length + 8 * compensate;
-    data = new char[size];
-    memset(data, 0, size);
-    *(int*)data = size;
+static const char* get_varint(const char* src, uint64_t* value) {
+    *value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *src++;
+        *value |= (uint64_t)(byte & 0x7f) << shift;
+        if (byte < 0x80) return src;
+    }
 }
 
+log_entry_t::log_entry_t() : log_entry_t(LOG_ENTRY_SIZE) {}
+
+log_entry_t::log_entry_t(int data_length, int compensate) : log_entry_t(LOG_ENTRY_EXT_SIZE + 2 * data_length + 8 * compensate) {}
+
 log_entry_t::log_entry_t(int size) {
-    data = new char[size];
+    data = size <= LOG_ENTRY_INLINE_SIZE ? inline_data : new char[size];
     memset(data, 0, size);
     *(int*)data = size;
 }
 
+log_entry_t::log_entry_t(char* view) : data(view), is_view(true) {}
+
+log_entry_t::log_entry_t(log_entry_t&& other) : is_view(other.is_view) {
+    if (other.data == other.inline_data) {
+        data = inline_data;
+        memcpy(data, other.data, other.get_log_size());
+    } else {
+        data = other.data;
+        other.data = other.inline_data;
+        other.is_view = false;
+        *(int*)other.data = 0;
+    }
+}
+
 log_entry_t::~log_entry_t() {
-    delete[] data;
+    if (data != inline_data && !is_view) delete[] data;
 }
 
 int log_entry_t::get_log_size() const {
@@ -45,18 +175,28 @@ int log_entry_t::get_trx_id() const {
     return *(int*)(data + 20);
 }
 int log_entry_t::get_type() const {
-    return *(int*)(data + 24);
+    return *(int*)(data + 24) & ~LOG_COMPACT;
+}
+bool log_entry_t::is_compact() const {
+    return *(int*)(data + 24) & LOG_COMPACT;
 }
 int64_t log_entry_t::get_table_id() const {
+    if (is_compact()) return get_compact_field(0);
     return *(int64_t*)(data + 28);
 }
 pagenum_t log_entry_t::get_pagenum() const {
+    if (is_compact()) return get_compact_field(1);
     return *(pagenum_t*)(data + 36);
 }
+int64_t log_entry_t::get_key() const {
+    return get_compact_field(2);
+}
 uint16_t log_entry_t::get_offset() const {
+    if (is_compact()) return get_compact_field(3);
     return *(uint16_t*)(data + 44);
 }
 uint16_t log_entry_t::get_length() const {
+    if (is_compact()) return get_compact_field(4);
     return *(uint16_t*)(data + 46);
 }
 void log_entry_t::get_old_image(char* dest) const {
@@ -65,10 +205,32 @@ void log_entry_t::get_old_image(char* dest) const {
 void log_entry_t::get_new_image(char* dest) const {
     memcpy(dest, data + 48 + get_length(), get_length());
 } // caller allocates
+const char* log_entry_t::get_diff() const {
+    uint64_t fields[5];
+    return get_compact_fields(fields);
+}
 uint64_t log_entry_t::get_next_undo_lsn() const {
+    if (is_compact()) {
+        uint64_t fields[5], next_undo_lsn;
+        get_varint(get_compact_fields(fields) + fields[4], &next_undo_lsn);
+        return next_undo_lsn;
+    }
     return *(uint64_t*)(data + 48 + 2 * get_length());
 }
 
+// Decodes the varints after the header, returns where the diff starts
+const char* log_entry_t::get_compact_fields(uint64_t fields[5]) const {
+    const char* src = data + LOG_ENTRY_SIZE;
+    for (int i = 0; i < 5; i++) src = get_varint(src, &fields[i]);
+    return src;
+}
+
+uint64_t log_entry_t::get_compact_field(int index) const {
+    uint64_t fields[5];
+    get_compact_fields(fields);
+    return fields[index];
+}
+
 void log_entry_t::set_lsn(uint64_t lsn) {
     *(uint64_t*)(data + 4) = lsn;
 }
@@ -103,135 +265,1208 @@ void log_entry_t::set_next_undo_lsn(uint64_t next_undo_lsn) {
     *(uint64_t*)(data + 48 + 2 * get_length()) = next_undo_lsn;
 }
 
-std::vector<log_entry_t*> log_buffer;
+log_entry_t create_begin_log(int trx_id) {
+    log_entry_t entry;
+    entry.set_trx_id(trx_id);
+    entry.set_type(LOG_BEGIN);
 
-uint64_t next_lsn = 0;
+    return entry;
+}
 
-log_entry_t* create_begin_log(int trx_id) {
-    log_entry_t* entry = new log_entry_t();
-    entry->set_trx_id(trx_id);
-    entry->set_type(LOG_BEGIN);
+log_entry_t create_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char* old, const char* new_) {
+    log_entry_t entry(length, 0);
+    entry.set_trx_id(trx_id);
+    entry.set_type(LOG_UPDATE);
+    entry.set_table_id(table_id);
+    entry.set_pagenum(pagenum);
+    entry.set_offset(offset);
+    entry.set_length(length);
+    entry.set_old_image(old);
+    entry.set_new_image(new_);
 
     return entry;
 }
 
-log_entry_t* create_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char* old, const char* new_) {
-    log_entry_t* entry = new log_entry_t(length, 0);
-    entry->set_trx_id(trx_id);
-    entry->set_type(LOG_UPDATE);
-    entry->set_table_id(table_id);
-    entry->set_pagenum(pagenum);
-    entry->set_offset(offset);
-    entry->set_length(length);
-    entry->set_old_image(old);
-    entry->set_new_image(new_);
+log_entry_t create_commit_log(int trx_id) {
+    log_entry_t entry;
+    entry.set_trx_id(trx_id);
+    entry.set_type(LOG_COMMIT);
 
     return entry;
 }
 
-log_entry_t* create_commit_log(int trx_id) {
-    log_entry_t* entry = new log_entry_t();
-    entry->set_trx_id(trx_id);
-    entry->set_type(LOG_COMMIT);
+log_entry_t create_rollback_log(int trx_id) {
+    log_entry_t entry;
+    entry.set_trx_id(trx_id);
+    entry.set_type(LOG_ROLLBACK);
 
     return entry;
 }
 
-log_entry_t* create_rollback_log(int trx_id) {
-    log_entry_t* entry = new log_entry_t();
-    entry->set_trx_id(trx_id);
-    entry->set_type(LOG_ROLLBACK);
+log_entry_t create_checkpoint_log() {
+    log_entry_t entry;
+    entry.set_type(LOG_CHECKPOINT);
 
     return entry;
 }
 
-log_entry_t* create_compensate_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char* old, const char* new_, uint64_t next_undo_lsn) {
-    log_entry_t* entry = new log_entry_t(length, 1);
-    entry->set_trx_id(trx_id);
-    entry->set_type(LOG_COMPENSATE);
-    entry->set_table_id(table_id);
-    entry->set_pagenum(pagenum);
-    entry->set_offset(offset);
-    entry->set_length(length);
-    entry->set_old_image(old);
-    entry->set_new_image(new_);
-    entry->set_next_undo_lsn(next_undo_lsn);
+log_entry_t create_compensate_log(int trx_id, int64_t table_id, pagenum_t pagenum, uint16_t offset, uint16_t length, const char* old, const char* new_, uint64_t next_undo_lsn) {
+    log_entry_t entry(length, 1);
+    entry.set_trx_id(trx_id);
+    entry.set_type(LOG_COMPENSATE);
+    entry.set_table_id(table_id);
+    entry.set_pagenum(pagenum);
+    entry.set_offset(offset);
+    entry.set_length(length);
+    entry.set_old_image(old);
+    entry.set_new_image(new_);
+    entry.set_next_undo_lsn(next_undo_lsn);
+
+    return entry;
+}
+
+// Only the bytes that changed are kept, XORed, so the same record takes
+// the value either way
+static log_entry_t create_compact_log(int type, int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key, uint16_t length, const char* old, const char* new_, const uint64_t* next_undo_lsn) {
+    uint16_t start = 0, end = length;
+    while (start < end && old[start] == new_[start]) start++;
+    while (end > start && old[end - 1] == new_[end - 1]) end--;
+
+    char fields[5 * 10], undo[10];
+    char* fields_end = fields;
+    fields_end = put_varint(fields_end, table_id);
+    fields_end = put_varint(fields_end, pagenum);
+    fields_end = put_varint(fields_end, key);
+    fields_end = put_varint(fields_end, start);
+    fields_end = put_varint(fields_end, end - start);
+    char* undo_end = next_undo_lsn == nullptr ? undo : put_varint(undo, *next_undo_lsn);
 
+    log_entry_t entry(LOG_ENTRY_SIZE + (fields_end - fields) + (end - start) + (undo_end - undo));
+    entry.set_trx_id(trx_id);
+    entry.set_type(type | LOG_COMPACT);
+    char* dest = entry.data + LOG_ENTRY_SIZE;
+    memcpy(dest, fields, fields_end - fields);
+    dest += fields_end - fields;
+    for (uint16_t i = start; i < end; i++) *dest++ = old[i] ^ new_[i];
+    memcpy(dest, undo, undo_end - undo);
     return entry;
 }
 
-void _log_flush() {
-    for (int i = 0; i < log_buffer.size(); i++) {
-        log_entry_t* log = log_buffer[i];
-        log_write(log);
+log_entry_t create_compact_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, int64_t key, uint16_t length, const char* old, const char* new_) {
+    return create_compact_log(LOG_UPDATE, trx_id, table_id, pagenum, key, length, old, new_, nullptr);
+}
+
+log_entry_t create_slot_update_log(int trx_id, int64_t table_id, pagenum_t pagenum, [[maybe_unused]] int64_t key, [[maybe_unused]] uint16_t offset, uint16_t length, const char* old, const char* new_) {
+    #if LOG_COMPACT_UPDATES
+    return create_compact_update_log(trx_id, table_id, pagenum, key, length, old, new_);
+    #else
+    return create_update_log(trx_id, table_id, pagenum, offset, length, old, new_);
+    #endif
+}
+
+// Points past the undone update, so undo after another crash resumes there
+log_entry_t create_compensate_log(const log_entry_t& undone, pagenum_t pagenum) {
+    uint64_t next_undo_lsn = undone.get_prev_lsn();
+    int length = undone.get_length();
+    if (undone.is_compact()) {
+        // The diff XORed into zeros gives it back
+        std::vector<char> zeros(length, 0);
+        return create_compact_log(LOG_COMPENSATE, undone.get_trx_id(), undone.get_table_id(), pagenum, undone.get_key(),
+            length, zeros.data(), undone.get_diff(), &next_undo_lsn);
+    }
+    std::vector<char> old(length), new_(length);
+    undone.get_old_image(old.data());
+    undone.get_new_image(new_.data());
+    return create_compensate_log(undone.get_trx_id(), undone.get_table_id(), pagenum, undone.get_offset(), length, new_.data(), old.data(), next_undo_lsn);
+}
+
+// Slot of key in a leaf page, -1 if it is not there
+static int find_slot(page_t* page, int64_t key) {
+    if (!PageIO::BPT::get_is_leaf(page)) return -1;
+    int lo = 0;
+    int hi = PageIO::BPT::get_num_keys(page) - 1;
+    while (lo <= hi) {
+        int mid = (lo + hi) / 2;
+        int64_t mid_key = PageIO::BPT::LeafPage::get_nth_slot(page, mid).get_key();
+        if (mid_key == key) return mid;
+        if (key < mid_key) hi = mid - 1;
+        else lo = mid + 1;
+    }
+    return -1;
+}
+
+bool log_apply(const log_entry_t& log, page_t* page, bool undo) {
+    int length = log.get_length();
+    if (log.is_compact()) {
+        int nth = find_slot(page, log.get_key());
+        if (nth < 0) return false;
+        slot_t slot = PageIO::BPT::LeafPage::get_nth_slot(page, nth);
+        uint16_t offset = slot.get_offset() + log.get_offset();
+        char value[PAGE_SIZE];
+        page->get_data(value, offset, length);
+        const char* diff = log.get_diff();
+        for (int i = 0; i < length; i++) value[i] ^= diff[i];
+        page->set_data(const_cast<const char*>(value), offset, length);
+        return true;
+    }
+    std::vector<char> image(length);
+    if (undo) log.get_old_image(image.data());
+    else log.get_new_image(image.data());
+    page->set_data(const_cast<const char*>(image.data()), log.get_offset(), length);
+    return true;
+}
+
+// Reads the leaf holding key. A split or merge after the update may have
+// moved it off the page the update names.
+static control_block_t* read_record_page(int64_t table_id, pagenum_t pagenum, int64_t key) {
+    control_block_t* ctrl_block = buf_read_page(table_id, pagenum);
+    if (ctrl_block->corrupted || find_slot(ctrl_block->frame, key) >= 0) return ctrl_block;
+    buf_return_ctrl_block(&ctrl_block);
+    pagenum_t leaf = find_leaf(table_id, buf_get_root_pagenum(table_id), key);
+    if (leaf == 0 || leaf == PAGENUM_CORRUPTED) leaf = pagenum;
+    return buf_read_page(table_id, leaf);
+}
+
+// A structure modification record has the 28 byte header, then varints
+// for the number of pages and, for each page, its table, pagenum and
+// number of byte ranges. A range is its distance from the end of the one
+// before, its length and its new bytes.
+struct smo_page_t {
+    int64_t table_id;
+    pagenum_t pagenum;
+    uint64_t num_ranges;
+    const char* ranges;
+};
+
+static std::vector<smo_page_t> smo_get_pages(const log_entry_t& log) {
+    std::vector<smo_page_t> pages;
+    uint64_t num_pages, table_id;
+    const char* src = get_varint(log.data + LOG_ENTRY_SIZE, &num_pages);
+    for (uint64_t i = 0; i < num_pages; i++) {
+        smo_page_t page;
+        src = get_varint(src, &table_id);
+        src = get_varint(src, &page.pagenum);
+        src = get_varint(src, &page.num_ranges);
+        page.table_id = table_id;
+        page.ranges = src;
+        for (uint64_t j = 0; j < page.num_ranges; j++) {
+            uint64_t gap, length;
+            src = get_varint(get_varint(src, &gap), &length);
+            src += length;
+        }
+        pages.push_back(page);
+    }
+    return pages;
+}
+
+static void smo_apply(const smo_page_t& page, page_t* frame) {
+    const char* src = page.ranges;
+    uint64_t offset = 0;
+    for (uint64_t j = 0; j < page.num_ranges; j++) {
+        uint64_t gap, length;
+        src = get_varint(get_varint(src, &gap), &length);
+        offset += gap;
+        frame->set_data(src, offset, length);
+        src += length;
+        offset += length;
+    }
+}
+
+// Ranges of bytes that differ, joined when the gap costs more than the
+// range header
+static std::vector<std::pair<uint64_t, uint64_t>> smo_diff(page_t* before, page_t* after) {
+    const char* old = reinterpret_cast<const char*>(before);
+    const char* now = reinterpret_cast<const char*>(after);
+    std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    for (uint64_t i = 0; i < PAGE_SIZE; i++) {
+        if (old[i] == now[i]) continue;
+        if (!ranges.empty() && i - ranges.back().second < 4) ranges.back().second = i + 1;
+        else ranges.emplace_back(i, i + 1);
+    }
+    return ranges;
+}
+
+// One for all tables, as the pages of a modification are tracked in one
+// list anyway
+pthread_rwlock_t smo_latch = PTHREAD_RWLOCK_INITIALIZER;
+
+void smo_begin() {
+    pthread_rwlock_wrlock(&smo_latch);
+    buf_track_begin();
+}
+
+void smo_shared_begin() {
+    pthread_rwlock_rdlock(&smo_latch);
+}
+
+void smo_shared_end() {
+    pthread_rwlock_unlock(&smo_latch);
+}
+
+void smo_end() {
+    struct changed_page_t {
+        tracked_page_t* page;
+        std::vector<std::pair<uint64_t, uint64_t>> ranges;
+    };
+    std::vector<changed_page_t> changed;
+    int size = LOG_ENTRY_SIZE + 10;
+    for (tracked_page_t& page : buf_tracked_pages()) {
+        if (!page.changed) continue;
+        pthread_mutex_lock(&page.ctrl_block->page_latch);
+        changed.push_back({ &page, smo_diff(&page.before, page.ctrl_block->frame) });
+        pthread_mutex_unlock(&page.ctrl_block->page_latch);
+        if (changed.back().ranges.empty()) {
+            changed.pop_back();
+            continue;
+        }
+        size += 30;
+        for (auto& range : changed.back().ranges) size += 20 + range.second - range.first;
+    }
+    if (changed.empty()) {
+        buf_track_end();
+        pthread_rwlock_unlock(&smo_latch);
+        return;
+    }
+
+    log_entry_t log(size);
+    log.set_type(LOG_SMO);
+    char* dest = put_varint(log.data + LOG_ENTRY_SIZE, changed.size());
+    for (changed_page_t& page : changed) {
+        dest = put_varint(dest, page.page->tid);
+        dest = put_varint(dest, page.page->ctrl_block->pagenum);
+        dest = put_varint(dest, page.ranges.size());
+        const char* frame = reinterpret_cast<const char*>(page.page->ctrl_block->frame);
+        uint64_t offset = 0;
+        for (auto& range : page.ranges) {
+            dest = put_varint(dest, range.first - offset);
+            dest = put_varint(dest, range.second - range.first);
+            memcpy(dest, frame + range.first, range.second - range.first);
+            dest += range.second - range.first;
+            offset = range.second;
+        }
+    }
+    *(int*)log.data = dest - log.data;
+    uint64_t lsn = add_to_log_buffer(log);
+
+    for (changed_page_t& page : changed) {
+        pthread_mutex_lock(&page.page->ctrl_block->page_latch);
+        PageIO::BPT::set_page_lsn(page.page->ctrl_block->frame, lsn);
+        pthread_mutex_unlock(&page.page->ctrl_block->page_latch);
+    }
+    buf_track_end();
+    pthread_rwlock_unlock(&smo_latch);
+}
+
+// Waits until every log record before end_lsn is on disk
+static void log_wait_flushed(uint64_t end_lsn) {
+    if (!log_opened || flushed_lsn >= end_lsn) return;
+
+    pthread_mutex_lock(&log_buffer_mutex);
+    if (flush_request_lsn < end_lsn) flush_request_lsn = end_lsn;
+    pthread_cond_signal(&log_writer_cond);
+    while (flushed_lsn < end_lsn) {
+        pthread_cond_wait(&log_flushed_cond, &log_buffer_mutex);
     }
-    log_buffer.clear();
-    fflush(log_file);
+    pthread_mutex_unlock(&log_buffer_mutex);
 }
 
-uint64_t add_to_log_buffer(log_entry_t* log) {
+static void log_wake_writer() {
     pthread_mutex_lock(&log_buffer_mutex);
-    if (log_buffer.size() == LOG_BUFFER_SIZE) {
-        _log_flush();
-    }
-    log->set_lsn(next_lsn);
-    log->set_prev_lsn(trx_table[log->get_trx_id()]->last_lsn);
-    next_lsn += log->get_log_size();
-    trx_table[log->get_trx_id()]->last_lsn = log->get_lsn();
-    log_buffer.push_back(log);
+    pthread_cond_signal(&log_writer_cond);
     pthread_mutex_unlock(&log_buffer_mutex);
-    return log->get_lsn();
 }
 
-void log_write(log_entry_t* log) {
-    int sz = log->get_log_size();
-    for (int i = 0; i < sz; i++) {
-        fprintf(log_file, "%c", log->data[i]);
+// Copies the record into the ring. Only the thread running the
+// transaction logs for it, so last_lsn needs no latch. Checkpoint records
+// belong to no transaction.
+uint64_t add_to_log_buffer(log_entry_t& log) {
+    trx_entry_t* trx = log.get_trx_id() == 0 ? nullptr : trx_get_entry(log.get_trx_id());
+    uint64_t size = log.get_log_size();
+    uint64_t lsn = next_lsn.fetch_add(size);
+    log.set_lsn(lsn);
+    if (trx != nullptr) {
+        // Set before the record is published, see log_checkpoint
+        log.set_prev_lsn(trx->last_lsn);
+        trx->last_lsn = lsn;
+        if (log.get_type() == LOG_BEGIN) trx->first_lsn = lsn;
+    }
+
+    if (!log_opened) return lsn;
+
+    // The ring must not overwrite what is not on disk yet, including the
+    // partial unit the next flush writes again
+    if (lsn + size + LOG_WRITE_UNIT > flushed_lsn + LOG_RING_SIZE) {
+        log_wait_flushed(lsn + size + LOG_WRITE_UNIT - LOG_RING_SIZE);
+    }
+
+    uint64_t pos = lsn % LOG_RING_SIZE;
+    uint64_t first = std::min(size, LOG_RING_SIZE - pos);
+    memcpy(log_ring + pos, log.data, first);
+    memcpy(log_ring, log.data + first, size - first);
+
+    // Publish in LSN order, earlier appenders are only a memcpy away
+    while (copied_lsn.load(std::memory_order_acquire) != lsn) sched_yield();
+    copied_lsn.store(lsn + size, std::memory_order_release);
+
+    uint64_t unflushed = lsn + size - flushed_lsn;
+    if (unflushed >= LOG_RING_SIZE / 2 && unflushed - size < LOG_RING_SIZE / 2) log_wake_writer();
+    return lsn;
+}
+
+static std::string log_segment_path(uint64_t n) {
+    return log_path_prefix + "." + std::to_string(n);
+}
+
+// Opens segment n, allocating it whole if it is new or short. Called with
+// log_segment_mutex held.
+static bool log_segment_open(uint64_t n) {
+    std::string path = log_segment_path(n);
+    int flags = O_WRONLY | O_CREAT;
+    #if LOG_DIRECT_IO
+    flags |= O_DIRECT;
+    #endif
+    log_segment_t segment;
+    segment.fd = open(path.c_str(), flags, 0644);
+    segment.read_fd = open(path.c_str(), O_RDONLY);
+    struct stat st;
+    bool other_format = segment.fd >= 0 && fstat(segment.fd, &st) == 0 && st.st_size != 0 && (uint64_t)st.st_size != LOG_SEGMENT_FILE_SIZE;
+    if (other_format) {
+        std::cout << "[ERROR] Log segment " << path << " was written with another LOG_COMPRESS" << std::endl;
+    }
+    if (segment.fd < 0 || segment.read_fd < 0 || other_format || fstat(segment.fd, &st) != 0
+        || ((uint64_t)st.st_size < LOG_SEGMENT_FILE_SIZE && posix_fallocate(segment.fd, 0, LOG_SEGMENT_FILE_SIZE) != 0)) {
+        std::cout << "[ERROR] Failed to open the log segment " << path << std::endl;
+        if (segment.fd >= 0) close(segment.fd);
+        if (segment.read_fd >= 0) close(segment.read_fd);
+        return false;
+    }
+    log_segments[n] = segment;
+    return true;
+}
+
+// Segment n for writing. The one after it is made ready as well, so a
+// flush reaching it doesn't wait for the allocation.
+static int log_segment_fd(uint64_t n) {
+    pthread_mutex_lock(&log_segment_mutex);
+    bool ok = (log_segments.count(n) || log_segment_open(n)) && (log_segments.count(n + 1) || log_segment_open(n + 1));
+    int fd = ok ? log_segments[n].fd : -1;
+    pthread_mutex_unlock(&log_segment_mutex);
+    return fd;
+}
+
+static void log_pwrite_segment(uint64_t n, const char* src, uint64_t length, uint64_t offset) {
+    int fd = log_segment_fd(n);
+    while (length > 0) {
+        ssize_t written = fd < 0 ? -1 : pwrite(fd, src, length, offset);
+        if (written < 0) {
+            std::cout << "[FATAL] Failed to write the log file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        src += written;
+        length -= written;
+        offset += written;
+    }
+}
+
+static void log_pwrite(const char* src, uint64_t length, uint64_t lsn) {
+    while (length > 0) {
+        uint64_t offset = lsn % LOG_SEGMENT_SIZE;
+        uint64_t part = std::min(length, LOG_SEGMENT_SIZE - offset);
+        log_pwrite_segment(lsn / LOG_SEGMENT_SIZE, src, part, offset);
+        src += part;
+        length -= part;
+        lsn += part;
+    }
+}
+
+#if LOG_COMPRESS
+// Compresses the ring bytes of [frame_lsn, end_lsn) into the frame's slot,
+// or stores them as they are if they don't shrink
+static void log_write_frame(uint64_t frame_lsn, uint64_t end_lsn) {
+    uint64_t length = end_lsn - frame_lsn;
+    uint64_t pos = frame_lsn % LOG_RING_SIZE;
+    uint64_t first = std::min(length, LOG_RING_SIZE - pos);
+    memcpy(log_frame, log_ring + pos, first);
+    memcpy(log_frame + first, log_ring, length - first);
+
+    log_frame_header_t* header = (log_frame_header_t*)log_frame_slot;
+    char* payload = log_frame_slot + sizeof(log_frame_header_t);
+    int stored = Compress::compress(log_frame, length, payload, length - 1);
+    header->codec = CODEC_LZ;
+    if (stored <= 0) {
+        memcpy(payload, log_frame, length);
+        stored = length;
+        header->codec = CODEC_RAW;
+    }
+    header->lsn = frame_lsn;
+    header->length = length;
+    header->stored_length = stored;
+    uint64_t offset = frame_lsn % LOG_SEGMENT_SIZE / LOG_FRAME_SIZE * LOG_FRAME_SLOT_SIZE;
+    pthread_mutex_lock(&log_frame_mutex);
+    log_pwrite_segment(frame_lsn / LOG_SEGMENT_SIZE, log_frame_slot, sizeof(log_frame_header_t) + stored, offset);
+    pthread_mutex_unlock(&log_frame_mutex);
+}
+
+// Decompresses the frame at frame_lsn into dest, returns its length, or
+// -1 if the slot doesn't hold that frame
+static int log_read_frame(int fd, uint64_t frame_lsn, char* dest) {
+    std::vector<char> slot(LOG_FRAME_SLOT_SIZE);
+    uint64_t offset = frame_lsn % LOG_SEGMENT_SIZE / LOG_FRAME_SIZE * LOG_FRAME_SLOT_SIZE;
+    pthread_mutex_lock(&log_frame_mutex);
+    ssize_t read = pread(fd, slot.data(), LOG_FRAME_SLOT_SIZE, offset);
+    pthread_mutex_unlock(&log_frame_mutex);
+    if (read != (ssize_t)LOG_FRAME_SLOT_SIZE) return -1;
+
+    log_frame_header_t* header = (log_frame_header_t*)slot.data();
+    const char* payload = slot.data() + sizeof(log_frame_header_t);
+    if (header->lsn != frame_lsn || header->length > LOG_FRAME_SIZE || header->stored_length > LOG_FRAME_SIZE) return -1;
+    if (header->codec == CODEC_RAW && header->stored_length == header->length) {
+        memcpy(dest, payload, header->length);
+        return header->length;
+    }
+    if (header->codec == CODEC_LZ && Compress::decompress(payload, header->stored_length, dest, header->length) == (int)header->length) {
+        return header->length;
+    }
+    return -1;
+}
+#endif
+
+static int log_read_fd(uint64_t n) {
+    pthread_mutex_lock(&log_segment_mutex);
+    auto it = log_segments.find(n);
+    int fd = it == log_segments.end() ? -1 : it->second.read_fd;
+    pthread_mutex_unlock(&log_segment_mutex);
+    return fd;
+}
+
+// Reads [lsn, lsn + length) of the log on disk
+static void log_pread(char* dest, uint64_t length, uint64_t lsn) {
+    #if LOG_COMPRESS
+    std::vector<char> frame(LOG_FRAME_SIZE);
+    while (length > 0) {
+        uint64_t frame_lsn = lsn - lsn % LOG_FRAME_SIZE;
+        uint64_t part = std::min(length, frame_lsn + LOG_FRAME_SIZE - lsn);
+        int frame_length = log_read_frame(log_read_fd(lsn / LOG_SEGMENT_SIZE), frame_lsn, frame.data());
+        if (frame_length < 0 || lsn + part > frame_lsn + frame_length) {
+            std::cout << "[FATAL] Failed to read the log file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        memcpy(dest, frame.data() + (lsn - frame_lsn), part);
+        dest += part;
+        length -= part;
+        lsn += part;
+    }
+    return;
+    #endif
+    while (length > 0) {
+        uint64_t n = lsn / LOG_SEGMENT_SIZE;
+        uint64_t offset = lsn % LOG_SEGMENT_SIZE;
+        int fd = log_read_fd(n);
+        ssize_t read = fd < 0 ? -1 : pread(fd, dest, std::min(length, LOG_SEGMENT_SIZE - offset), offset);
+        if (read <= 0) {
+            std::cout << "[FATAL] Failed to read the log file" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        dest += read;
+        length -= read;
+        lsn += read;
+    }
+}
+
+static void log_sync(uint64_t start_lsn, uint64_t end_lsn) {
+    for (uint64_t n = start_lsn / LOG_SEGMENT_SIZE; n <= (end_lsn - 1) / LOG_SEGMENT_SIZE; n++) {
+        fdatasync(log_segment_fd(n));
+    }
+}
+
+// Writes the ring bytes of [start_lsn, end_lsn) and syncs them
+void log_write(uint64_t start_lsn, uint64_t end_lsn) {
+    #if LOG_COMPRESS
+    for (uint64_t frame_lsn = start_lsn - start_lsn % LOG_FRAME_SIZE; frame_lsn < end_lsn; frame_lsn += LOG_FRAME_SIZE) {
+        log_write_frame(frame_lsn, std::min(end_lsn, frame_lsn + LOG_FRAME_SIZE));
+    }
+    log_sync(start_lsn, end_lsn);
+    return;
+    #endif
+
+    uint64_t block_lsn = start_lsn & ~(LOG_BLOCK_SIZE - 1);
+    uint64_t tail_lsn = end_lsn & ~(LOG_BLOCK_SIZE - 1);
+    while (block_lsn < tail_lsn) {
+        uint64_t pos = block_lsn % LOG_RING_SIZE;
+        uint64_t length = std::min(tail_lsn - block_lsn, LOG_RING_SIZE - pos);
+        log_pwrite(log_ring + pos, length, block_lsn);
+        block_lsn += length;
+    }
+    if (tail_lsn < end_lsn) {
+        memcpy(log_tail_block, log_ring + tail_lsn % LOG_RING_SIZE, end_lsn - tail_lsn);
+        memset(log_tail_block + (end_lsn - tail_lsn), 0, LOG_BLOCK_SIZE - (end_lsn - tail_lsn));
+        log_pwrite(log_tail_block, LOG_BLOCK_SIZE, tail_lsn);
+    }
+    log_sync(start_lsn, end_lsn);
+}
+
+void* log_writer_main(void*) {
+    pthread_mutex_lock(&log_buffer_mutex);
+    while (true) {
+        while (!log_writer_stop && flush_request_lsn <= flushed_lsn && copied_lsn - flushed_lsn < LOG_RING_SIZE / 2) {
+            pthread_cond_wait(&log_writer_cond, &log_buffer_mutex);
+        }
+
+        uint64_t start_lsn = flushed_lsn;
+        uint64_t end_lsn = copied_lsn;
+        if (start_lsn == end_lsn) {
+            if (log_writer_stop && next_lsn == end_lsn) break;
+            // Reserved but still being copied
+            pthread_mutex_unlock(&log_buffer_mutex);
+            sched_yield();
+            pthread_mutex_lock(&log_buffer_mutex);
+            continue;
+        }
+
+        // Everyone who appended while the last batch was written goes in this one
+        pthread_mutex_unlock(&log_buffer_mutex);
+        log_write(start_lsn, end_lsn);
+        pthread_mutex_lock(&log_buffer_mutex);
+
+        flushed_lsn = end_lsn;
+        pthread_cond_broadcast(&log_flushed_cond);
+        if (checkpointer_running && end_lsn - checkpoint_lsn >= LOG_CHECKPOINT_INTERVAL) {
+            pthread_cond_signal(&checkpoint_cond);
+        }
     }
-    // fwrite(const_cast<char*>(log->data), 1, log->get_log_size(), log_file);
+    pthread_mutex_unlock(&log_buffer_mutex);
+    return nullptr;
+}
+
+// Flushes the log up to and including the record at lsn
+void log_flush_until(uint64_t lsn) {
+    log_wait_flushed(lsn + 1);
 }
 
 void log_flush() {
+    log_wait_flushed(next_lsn);
+}
+
+uint64_t log_next_lsn() {
+    return next_lsn;
+}
+
+static bool read_master(master_record_t* master) {
+    FILE* file = fopen(master_path.c_str(), "rb");
+    if (file == nullptr) return false;
+
+    uint64_t header[4];
+    bool ok = fread(header, sizeof(header), 1, file) == 1;
+    if (ok) {
+        master->checkpoint_lsn = header[0];
+        master->redo_lsn = header[1];
+        master->att.resize(header[2]);
+        master->dpt.resize(header[3]);
+        ok = fread(master->att.data(), sizeof(att_entry_t), header[2], file) == header[2]
+            && fread(master->dpt.data(), sizeof(dpt_entry_t), header[3], file) == header[3];
+    }
+    fclose(file);
+    if (!ok) {
+        std::cout << "[FATAL] Corrupted master record " << master_path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    return true;
+}
+
+// Written to a temporary file and renamed over the old one, so a crash
+// leaves either checkpoint whole
+static bool write_master(const master_record_t& master) {
+    std::string tmp_path = master_path + ".tmp";
+    FILE* file = fopen(tmp_path.c_str(), "wb");
+    if (file == nullptr) {
+        std::cout << "[ERROR] Failed to write the master record " << tmp_path << std::endl;
+        return false;
+    }
+
+    uint64_t header[4] = { master.checkpoint_lsn, master.redo_lsn, master.att.size(), master.dpt.size() };
+    fwrite(header, sizeof(header), 1, file);
+    fwrite(master.att.data(), sizeof(att_entry_t), master.att.size(), file);
+    fwrite(master.dpt.data(), sizeof(dpt_entry_t), master.dpt.size(), file);
+    bool ok = fflush(file) == 0 && fdatasync(fileno(file)) == 0;
+    fclose(file);
+
+    if (!ok || rename(tmp_path.c_str(), master_path.c_str()) != 0) {
+        std::cout << "[ERROR] Failed to write the master record " << master_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+// Segments wholly before keep_lsn are renamed after the last segment to
+// be written again, up to LOG_SPARE_SEGMENTS of them, the rest deleted
+static void log_reclaim(uint64_t keep_lsn) {
+    pthread_mutex_lock(&log_segment_mutex);
+    uint64_t in_use = next_lsn / LOG_SEGMENT_SIZE;
+    while (!log_segments.empty() && (log_segments.begin()->first + 1) * LOG_SEGMENT_SIZE <= keep_lsn) {
+        uint64_t n = log_segments.begin()->first;
+        log_segment_t segment = log_segments.begin()->second;
+        log_segments.erase(log_segments.begin());
+
+        uint64_t last = log_segments.empty() ? n : log_segments.rbegin()->first;
+        if (last - in_use < LOG_SPARE_SEGMENTS && rename(log_segment_path(n).c_str(), log_segment_path(last + 1).c_str()) == 0) {
+            log_segments[last + 1] = segment;
+            continue;
+        }
+        close(segment.fd);
+        close(segment.read_fd);
+        unlink(log_segment_path(n).c_str());
+    }
+    pthread_mutex_unlock(&log_segment_mutex);
+}
+
+// Fuzzy checkpoint, transactions and the buffer keep running meanwhile
+void log_checkpoint() {
+    if (!log_opened) return;
+    pthread_mutex_lock(&checkpoint_mutex);
+
+    // Pages dirty since before the last checkpoint go to disk, so redo
+    // never has to reach back further than that
+    pthread_mutex_lock(&log_buffer_mutex);
+    uint64_t last_checkpoint_lsn = checkpoint_lsn;
+    pthread_mutex_unlock(&log_buffer_mutex);
+    buf_flush_old_pages(last_checkpoint_lsn);
+
+    master_record_t master;
+    log_entry_t log = create_checkpoint_log();
+    master.checkpoint_lsn = add_to_log_buffer(log);
+
+    // Every record before the checkpoint is copied by now, so the
+    // transaction table has their LSNs. Later ones are seen by analysis.
+    log_flush_until(master.checkpoint_lsn);
+    master.att = trx_snapshot();
+    master.dpt = buf_get_dirty_pages();
+
+    master.redo_lsn = master.checkpoint_lsn;
+    for (auto& page : master.dpt) master.redo_lsn = std::min(master.redo_lsn, page.rec_lsn);
+    // Undo may follow an active transaction back to its begin record
+    uint64_t keep_lsn = master.redo_lsn;
+    for (auto& trx : master.att) keep_lsn = std::min(keep_lsn, trx.first_lsn);
+
+    if (write_master(master)) {
+        pthread_mutex_lock(&log_buffer_mutex);
+        checkpoint_lsn = master.checkpoint_lsn;
+        pthread_mutex_unlock(&log_buffer_mutex);
+        log_reclaim(keep_lsn);
+    }
+    pthread_mutex_unlock(&checkpoint_mutex);
+}
+
+void* checkpointer_main(void*) {
     pthread_mutex_lock(&log_buffer_mutex);
-    _log_flush();
+    while (!checkpointer_stop) {
+        if (next_lsn - checkpoint_lsn < LOG_CHECKPOINT_INTERVAL) {
+            pthread_cond_wait(&checkpoint_cond, &log_buffer_mutex);
+            continue;
+        }
+        pthread_mutex_unlock(&log_buffer_mutex);
+        log_checkpoint();
+        pthread_mutex_lock(&log_buffer_mutex);
+    }
     pthread_mutex_unlock(&log_buffer_mutex);
+    return nullptr;
+}
+
+// Maps segments [first, last] next to each other. Compressed frames are
+// read into anonymous memory instead, from the one at start_lsn up to the
+// first slot not holding the next frame.
+static bool log_map_open(uint64_t first, uint64_t last, [[maybe_unused]] uint64_t start_lsn) {
+    log_map = log_map_t();
+    uint64_t size = (last - first + 1) * LOG_SEGMENT_SIZE;
+    void* base = mmap(NULL, size, LOG_COMPRESS ? PROT_READ | PROT_WRITE : PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) return false;
+    log_map.base = (char*)base;
+    log_map.start_lsn = first * LOG_SEGMENT_SIZE;
+    log_map.size = size;
+
+    for (uint64_t n = first; n <= last; n++) {
+        auto it = log_segments.find(n);
+        if (it == log_segments.end()) {
+            std::cout << "[ERROR] Log segment " << log_segment_path(n) << " is missing" << std::endl;
+            return false;
+        }
+        char* at = log_map.base + (n - first) * LOG_SEGMENT_SIZE;
+        if (!LOG_COMPRESS && mmap(at, LOG_SEGMENT_SIZE, PROT_READ, MAP_SHARED | MAP_FIXED, it->second.read_fd, 0) == MAP_FAILED) return false;
+    }
+
+    #if LOG_COMPRESS
+    for (uint64_t frame_lsn = start_lsn - start_lsn % LOG_FRAME_SIZE; frame_lsn < log_map.start_lsn + size; frame_lsn += LOG_FRAME_SIZE) {
+        int length = log_read_frame(log_segments[frame_lsn / LOG_SEGMENT_SIZE].read_fd, frame_lsn, log_map.base + (frame_lsn - log_map.start_lsn));
+        if (length < (int)LOG_FRAME_SIZE) break;
+    }
+    #endif
+    return true;
+}
+
+static void log_map_close() {
+    if (log_map.base != nullptr) munmap(log_map.base, log_map.size);
+    log_map = log_map_t();
+}
+
+static char* log_map_at(uint64_t lsn) {
+    return log_map.base + (lsn - log_map.start_lsn);
+}
+
+// Segments are allocated with zeros and may be recycled, the log ends at
+// the first record whose size is zero, runs past the last segment or
+// doesn't carry its own LSN
+static uint64_t log_find_end(uint64_t start_lsn) {
+    uint64_t map_end = log_map.start_lsn + log_map.size;
+    uint64_t end = start_lsn;
+    while (end + LOG_ENTRY_SIZE <= map_end) {
+        log_entry_t log(log_map_at(end));
+        int sz = log.get_log_size();
+        if (sz < LOG_ENTRY_SIZE || end + sz > map_end || log.get_lsn() != end) break;
+        end += sz;
+    }
+    return end;
+}
+
+// Segment numbers of the files <log>.<n>
+static std::vector<uint64_t> log_list_segments() {
+    size_t slash = log_path_prefix.rfind('/');
+    std::string dir = slash == std::string::npos ? "." : log_path_prefix.substr(0, slash + 1);
+    std::string prefix = (slash == std::string::npos ? log_path_prefix : log_path_prefix.substr(slash + 1)) + ".";
+
+    std::vector<uint64_t> segments;
+    DIR* d = opendir(dir.c_str());
+    if (d == nullptr) return segments;
+    while (struct dirent* entry = readdir(d)) {
+        std::string name = entry->d_name;
+        if (name.size() <= prefix.size() || name.compare(0, prefix.size(), prefix) != 0) continue;
+        std::string number = name.substr(prefix.size());
+        if (number.find_first_not_of("0123456789") != std::string::npos) continue;
+        segments.push_back(std::stoull(number));
+    }
+    closedir(d);
+    std::sort(segments.begin(), segments.end());
+    return segments;
+}
+
+static void log_segments_close() {
+    for (auto& segment : log_segments) {
+        close(segment.second.fd);
+        close(segment.second.read_fd);
+    }
+    log_segments.clear();
 }
 
 int init_recovery(char* log_path) {
-    log_file = fopen(log_path, "a+");
-    pthread_mutex_init(&log_buffer_mutex, NULL);
+    log_path_prefix = log_path;
+    master_path = std::string(log_path) + ".master";
+    master_record = master_record_t();
+    bool has_master = read_master(&master_record);
+
+    for (uint64_t n : log_list_segments()) {
+        if (!log_segment_open(n)) {
+            log_segments_close();
+            return -1;
+        }
+    }
+    if (log_segments.empty() && !log_segment_open(0)) return -1;
+    uint64_t first = log_segments.begin()->first;
+    uint64_t last = log_segments.rbegin()->first;
+
+    if (has_master && (master_record.redo_lsn < first * LOG_SEGMENT_SIZE || master_record.checkpoint_lsn >= (last + 1) * LOG_SEGMENT_SIZE)) {
+        std::cout << "[ERROR] Master record " << master_path << " doesn't match the log, ignoring it" << std::endl;
+        master_record = master_record_t();
+        has_master = false;
+    }
+    // Without a checkpoint, the log starts with the first segment
+    if (!has_master) {
+        master_record.checkpoint_lsn = first * LOG_SEGMENT_SIZE;
+        master_record.redo_lsn = first * LOG_SEGMENT_SIZE;
+    }
+    checkpoint_lsn = master_record.checkpoint_lsn;
+
+    if (!log_map_open(master_record.redo_lsn / LOG_SEGMENT_SIZE, last, master_record.redo_lsn)) {
+        std::cout << "[ERROR] Failed to map the log file " << log_path << std::endl;
+        log_map_close();
+        log_segments_close();
+        return -1;
+    }
+    uint64_t end = log_find_end(master_record.checkpoint_lsn);
+    log_map.end = end;
+    next_lsn = end;
+    copied_lsn = end;
+    flushed_lsn = end;
+
+    // The first flush writes the last partial unit again
+    uint64_t block_lsn = end - end % LOG_WRITE_UNIT;
+    memcpy(log_ring + block_lsn % LOG_RING_SIZE, log_map_at(block_lsn), end - block_lsn);
+
+    flush_request_lsn = 0;
+    log_writer_stop = false;
+    checkpointer_stop = false;
+    log_opened = true;
+    pthread_create(&log_writer, NULL, log_writer_main, NULL);
     return 0;
 }
 
 int shutdown_recovery() {
-    fclose(log_file);
-    pthread_mutex_destroy(&log_buffer_mutex);
+    if (!log_opened) return 0;
+
+    // Losers have to be rolled back before the buffer goes away
+    if (undo_running) pthread_join(undo_thread, NULL);
+    undo_running = false;
+    log_map_close();
+
+    pthread_mutex_lock(&log_buffer_mutex);
+    checkpointer_stop = true;
+    pthread_cond_signal(&checkpoint_cond);
+    pthread_mutex_unlock(&log_buffer_mutex);
+    if (checkpointer_running) pthread_join(checkpointer, NULL);
+    checkpointer_running = false;
+
+    pthread_mutex_lock(&log_buffer_mutex);
+    log_writer_stop = true;
+    pthread_cond_signal(&log_writer_cond);
+    pthread_mutex_unlock(&log_buffer_mutex);
+    pthread_join(log_writer, NULL);
+
+    log_segments_close();
+    log_opened = false;
+    return 0;
+}
+
+int log_remove(char* log_path) {
+    log_path_prefix = log_path;
+    for (uint64_t n : log_list_segments()) unlink(log_segment_path(n).c_str());
+    std::string master = std::string(log_path) + ".master";
+    unlink(master.c_str());
+    unlink((master + ".tmp").c_str());
     return 0;
 }
 
 
+// Applies an update or CLR record if its page is older
+static void redo_apply(const log_entry_t* log, FILE* logmsg_file) {
+    control_block_t* ctrl_block = buf_read_page(log->get_table_id(), log->get_pagenum());
+    if (ctrl_block->corrupted) {
+        fprintf(logmsg_file, "LSN %lu [CORRUPTED] Page %lu redo skipped\n", log->get_lsn(), log->get_pagenum());
+        buf_return_ctrl_block(&ctrl_block);
+    } else if (PageIO::BPT::get_page_lsn(ctrl_block->frame) < log->get_lsn()) {
+        fprintf(logmsg_file, "LSN %lu [UPDATE] Transaction id %d redo apply\n", log->get_lsn(), log->get_trx_id());
+        PageIO::BPT::set_page_lsn(ctrl_block->frame, log->get_lsn());
+        if (!log_apply(*log, ctrl_block->frame, false)) {
+            fprintf(logmsg_file, "LSN %lu [ERROR] Key %ld not on page %lu\n", log->get_lsn(), log->get_key(), log->get_pagenum());
+        }
+        buf_mark_dirty(ctrl_block, log->get_lsn());
+        buf_return_ctrl_block(&ctrl_block);
+    } else {
+        if (log->get_type() == LOG_UPDATE) {
+            fprintf(logmsg_file, "LSN %lu [COONSIDER-REDO] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
+        }
+        buf_return_ctrl_block(&ctrl_block);
+    }
+}
+
+// Tables of a tablespace share its header and catalog pages, so pages
+// are told apart by their file. Log records and the dirty page table may
+// name any table of the file.
+static std::pair<int64_t, pagenum_t> page_key(int64_t table_id, pagenum_t pagenum) {
+    auto it = table_id_map.find(table_id);
+    return std::make_pair(it == table_id_map.end() ? -1 : it->second, pagenum);
+}
+
+static int redo_worker_of(int64_t table_id, pagenum_t pagenum) {
+    std::pair<int64_t, pagenum_t> key = page_key(table_id, pagenum);
+    return (uint64_t)(key.first * 1000003 + key.second) % REDO_THREADS;
+}
+
+// Applies the pages of a structure modification record that are older,
+// only those of the given redo worker if there is one
+static void redo_apply_smo(const log_entry_t* log, FILE* logmsg_file, int worker) {
+    for (const smo_page_t& page : smo_get_pages(*log)) {
+        if (worker >= 0 && redo_worker_of(page.table_id, page.pagenum) != worker) continue;
+        control_block_t* ctrl_block = buf_read_page(page.table_id, page.pagenum);
+        if (ctrl_block->corrupted) {
+            fprintf(logmsg_file, "LSN %lu [CORRUPTED] Page %lu redo skipped\n", log->get_lsn(), page.pagenum);
+        } else if (PageIO::BPT::get_page_lsn(ctrl_block->frame) < log->get_lsn()) {
+            fprintf(logmsg_file, "LSN %lu [SMO] Page %lu redo apply\n", log->get_lsn(), page.pagenum);
+            // The logged ranges may cover the page LSN, stamp it after them
+            smo_apply(page, ctrl_block->frame);
+            PageIO::BPT::set_page_lsn(ctrl_block->frame, log->get_lsn());
+            buf_mark_dirty(ctrl_block, log->get_lsn());
+        }
+        buf_return_ctrl_block(&ctrl_block);
+    }
+}
+
+// Parallel redo. The log is read once and each record goes to the worker
+// of its page, so a page still sees its records in LSN order. A structure
+// modification goes to the workers of all of its pages.
+struct redo_queue_t {
+    pthread_mutex_t latch;
+    pthread_cond_t cond; // records pushed or popped, or the queue closed
+    std::deque<char*> records; // in the log mapping
+    bool closed;
+    FILE* logmsg_file;
+    int index;
+    pthread_t worker;
+};
+
+static void redo_push(redo_queue_t* queue, char* record) {
+    pthread_mutex_lock(&queue->latch);
+    while (queue->records.size() >= REDO_QUEUE_SIZE) pthread_cond_wait(&queue->cond, &queue->latch);
+    queue->records.push_back(record);
+    pthread_cond_broadcast(&queue->cond);
+    pthread_mutex_unlock(&queue->latch);
+}
+
+static void* redo_worker_main(void* arg) {
+    redo_queue_t* queue = (redo_queue_t*)arg;
+    pthread_mutex_lock(&queue->latch);
+    while (true) {
+        while (queue->records.empty() && !queue->closed) pthread_cond_wait(&queue->cond, &queue->latch);
+        if (queue->records.empty()) break;
+
+        log_entry_t log(queue->records.front());
+        queue->records.pop_front();
+        pthread_cond_broadcast(&queue->cond);
+        pthread_mutex_unlock(&queue->latch);
+        if (log.get_type() == LOG_SMO) redo_apply_smo(&log, queue->logmsg_file, queue->index);
+        else redo_apply(&log, queue->logmsg_file);
+        pthread_mutex_lock(&queue->latch);
+    }
+    pthread_mutex_unlock(&queue->latch);
+    return nullptr;
+}
+
+// Undo worker. It always undoes the latest record of its losers next,
+// so it reads the log backwards and keeps a window of it in memory.
+struct undo_worker_t {
+    std::priority_queue<std::pair<uint64_t, int>> next_undo; // (lsn, trx_id)
+    std::vector<char> window;
+    uint64_t window_lsn = 0;
+    FILE* logmsg_file;
+    std::atomic<int>* budget; // records left to undo, for crash tests
+    pthread_t thread;
+};
+
+// Reads the record at lsn through the worker's window
+static log_entry_t undo_read_log(undo_worker_t* worker, uint64_t lsn) {
+    uint64_t window_end = worker->window_lsn + worker->window.size();
+    if (lsn < worker->window_lsn || lsn + LOG_ENTRY_SIZE > window_end || lsn + *(int*)&worker->window[lsn - worker->window_lsn] > window_end) {
+        // The window ends past the record, the ones undone next come before it
+        uint64_t end = std::min<uint64_t>(lsn + LOG_ENTRY_INLINE_SIZE, flushed_lsn);
+        uint64_t start = end > UNDO_READ_SIZE ? end - UNDO_READ_SIZE : 0;
+        worker->window.resize(end - start);
+        worker->window_lsn = start;
+        log_pread(worker->window.data(), end - start, start);
+    }
+
+    int sz = *(int*)&worker->window[lsn - worker->window_lsn];
+    log_entry_t log(sz);
+    if (lsn + sz <= worker->window_lsn + worker->window.size()) {
+        memcpy(log.data, &worker->window[lsn - worker->window_lsn], sz);
+    } else {
+        log_pread(log.data, sz, lsn);
+    }
+    return log;
+}
+
+static void* undo_worker_main(void* arg) {
+    undo_worker_t* worker = (undo_worker_t*)arg;
+    FILE* logmsg_file = worker->logmsg_file;
+
+    while (!worker->next_undo.empty() && (*worker->budget)-- > 0) {
+        uint64_t lsn = worker->next_undo.top().first;
+        int trx_id = worker->next_undo.top().second;
+        worker->next_undo.pop();
+
+        log_entry_t entry = undo_read_log(worker, lsn);
+        log_entry_t* log = &entry;
+
+        if (log->get_type() == LOG_COMPENSATE) {
+            // Already undone before the crash, skip what it undid
+            fprintf(logmsg_file, "LSN %lu [CLR] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
+            worker->next_undo.push(std::make_pair(log->get_next_undo_lsn(), trx_id));
+        } else if (log->get_type() == LOG_UPDATE) {
+            // New transactions may be inserting after an instant restart
+            smo_shared_begin();
+            control_block_t* ctrl_block = log->is_compact()
+                ? read_record_page(log->get_table_id(), log->get_pagenum(), log->get_key())
+                : buf_read_page(log->get_table_id(), log->get_pagenum());
+            if (ctrl_block->corrupted) {
+                fprintf(logmsg_file, "LSN %lu [CORRUPTED] Page %lu undo skipped\n", log->get_lsn(), log->get_pagenum());
+                buf_return_ctrl_block(&ctrl_block);
+            } else if (PageIO::BPT::get_page_lsn(ctrl_block->frame) >= log->get_lsn()) {
+                fprintf(logmsg_file, "LSN %lu [UPDATE] Transaction id %d undo apply\n", log->get_lsn(), log->get_trx_id());
+
+                // The CLR points past this record, so undo after another
+                // crash resumes where this one stops
+                log_entry_t new_log = create_compensate_log(*log, ctrl_block->pagenum);
+                uint64_t new_lsn = add_to_log_buffer(new_log);
+
+                PageIO::BPT::set_page_lsn(ctrl_block->frame, new_lsn);
+                if (!log_apply(*log, ctrl_block->frame, true)) {
+                    fprintf(logmsg_file, "LSN %lu [ERROR] Key %ld not found for undo\n", log->get_lsn(), log->get_key());
+                }
+                buf_return_ctrl_block(&ctrl_block, 1);
+            } else {
+                buf_return_ctrl_block(&ctrl_block);
+            }
+            smo_shared_end();
+            worker->next_undo.push(std::make_pair(log->get_prev_lsn(), trx_id));
+        } else if (log->get_type() == LOG_BEGIN) {
+            fprintf(logmsg_file, "LSN %lu [BEGIN] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
+            log_entry_t entry = create_rollback_log(log->get_trx_id());
+            add_to_log_buffer(entry);
+            trx_remove(log->get_trx_id());
+        } else {
+            fprintf(logmsg_file, "LSN %lu [UNKNOWN]\n", log->get_lsn());
+        }
+    }
+    return nullptr;
+}
+
+// Undo pass. Run by recover_main, or in the background after an instant
+// restart, in which case it frees itself.
+struct undo_pass_t {
+    std::vector<undo_worker_t> workers;
+    std::atomic<int> budget;
+    FILE* logmsg_file;
+    bool checkpoint; // start checkpointing once the losers are gone
+};
+
+static void* undo_pass_main(void* arg) {
+    undo_pass_t* pass = (undo_pass_t*)arg;
+    for (undo_worker_t& worker : pass->workers) {
+        worker.logmsg_file = pass->logmsg_file;
+        worker.budget = &pass->budget;
+        pthread_create(&worker.thread, NULL, undo_worker_main, &worker);
+    }
+    for (undo_worker_t& worker : pass->workers) pthread_join(worker.thread, NULL);
+
+    log_flush();
+
+    fprintf(pass->logmsg_file, "[UNDO] Undo pass end\n");
+    fflush(pass->logmsg_file);
+
+    if (pass->checkpoint) {
+        // Recovery is done, so the next restart starts from here
+        log_checkpoint();
+        pthread_mutex_lock(&log_buffer_mutex);
+        checkpointer_running = true;
+        pthread_mutex_unlock(&log_buffer_mutex);
+        pthread_create(&checkpointer, NULL, checkpointer_main, NULL);
+    }
+    delete pass;
+    return nullptr;
+}
+
+static void open_log_table(int64_t table_id, std::set<int>& opened_tables) {
+    if (opened_tables.insert(table_id).second) {
+        std::string filename = "DATA";
+        filename += std::to_string(table_id);
+        open_table(const_cast<char*>(filename.c_str()));
+    }
+}
+
+// X locks a loser's records again, so new transactions wait for its
+// rollback instead of seeing its changes. Its chain is followed back to
+// the begin record, skipping what CLRs say is undone already.
+static void undo_relock(int trx_id, uint64_t last_lsn, undo_worker_t* reader, std::set<int>& opened_tables) {
+    // Record locks are taken on slot numbers. Compact updates log the key,
+    // fixed ones the offset of its value in the page.
+    std::map<std::pair<int64_t, pagenum_t>, std::pair<std::set<int64_t>, std::set<uint16_t>>> pages;
+    uint64_t lsn = last_lsn;
+    while (true) {
+        log_entry_t log = undo_read_log(reader, lsn);
+        if (log.get_type() == LOG_COMPENSATE) {
+            lsn = log.get_next_undo_lsn();
+        } else if (log.get_type() == LOG_UPDATE) {
+            auto& page = pages[std::make_pair(log.get_table_id(), log.get_pagenum())];
+            if (log.is_compact()) page.first.insert(log.get_key());
+            else page.second.insert(log.get_offset());
+            lsn = log.get_prev_lsn();
+        } else {
+            break;
+        }
+    }
+
+    std::map<std::pair<int64_t, pagenum_t>, std::set<int>> slots;
+    for (auto& page : pages) {
+        int64_t table_id = page.first.first;
+        open_log_table(table_id, opened_tables);
+        for (int64_t key : page.second.first) {
+            control_block_t* ctrl_block = read_record_page(table_id, page.first.second, key);
+            int i = ctrl_block->corrupted ? -1 : find_slot(ctrl_block->frame, key);
+            if (i >= 0) slots[std::make_pair(table_id, ctrl_block->pagenum)].insert(i);
+            buf_return_ctrl_block(&ctrl_block);
+        }
+        if (!page.second.second.empty()) {
+            control_block_t* ctrl_block = buf_read_page(table_id, page.first.second);
+            int num_keys = ctrl_block->corrupted ? 0 : PageIO::BPT::get_num_keys(ctrl_block->frame);
+            for (int i = 0; i < num_keys; i++) {
+                slot_t slot = PageIO::BPT::LeafPage::get_nth_slot(ctrl_block->frame, i);
+                if (page.second.second.count(slot.get_offset())) slots[page.first].insert(i);
+            }
+            buf_return_ctrl_block(&ctrl_block);
+        }
+    }
+
+    trx_entry_t* trx = trx_check_active(trx_id);
+    pthread_mutex_lock(&trx->trx_latch);
+    for (auto& page : slots) {
+        for (int i : page.second) {
+            lock_t* lock = lock_acquire(page.first.first, page.first.second, i, trx_id, LOCK_MODE_EXCLUSIVE);
+            add_to_trx_list(trx, lock);
+        }
+    }
+    pthread_mutex_unlock(&trx->trx_latch);
+}
+
 void recover_main(char* logmsg_path, int flag, int log_num) {
     FILE* logmsg_file = fopen(logmsg_path, "w");
-    rewind(log_file);
-    // Analysis Pass
+    // Analysis Pass, from the last checkpoint
     std::set<int> winners, opened_tables;
     std::map<int, uint64_t> losers;
+    for (auto& trx : master_record.att) {
+        if (trx.last_lsn != 0) losers[trx.trx_id] = trx.last_lsn;
+    }
+    // Dirty page table, page_key -> recLSN
+    std::map<std::pair<int64_t, pagenum_t>, uint64_t> dirty_pages;
+    for (auto& page : master_record.dpt) {
+        open_log_table(page.table_id, opened_tables);
+        auto it = dirty_pages.emplace(page_key(page.table_id, page.pagenum), page.rec_lsn).first;
+        it->second = std::min(it->second, page.rec_lsn);
+    }
 
     fprintf(logmsg_file, "[ANALYSIS] Analysis pass start\n");
-    while (true) {
-        int sz;
-        if (fread(&sz, sizeof(int), 1, log_file) != 1) break;
-        log_entry_t* log = new log_entry_t(sz);
-        fseek(log_file, -sizeof(int), SEEK_CUR);
-        fread(log->data, 1, sz, log_file);
+    uint64_t advise_lsn = master_record.redo_lsn & ~(LOG_BLOCK_SIZE - 1);
+    if (log_map.end > advise_lsn) {
+        madvise(log_map_at(advise_lsn), log_map.end - advise_lsn, MADV_SEQUENTIAL);
+    }
+    for (uint64_t lsn = master_record.checkpoint_lsn; lsn < log_map.end;) {
+        log_entry_t entry(log_map_at(lsn));
+        log_entry_t* log = &entry;
+        lsn += log->get_log_size();
+        if (log->get_type() == LOG_CHECKPOINT) {
+            continue;
+        }
+        if (log->get_type() == LOG_SMO) {
+            // Belongs to no transaction and is never undone
+            for (const smo_page_t& page : smo_get_pages(*log)) {
+                open_log_table(page.table_id, opened_tables);
+                dirty_pages.emplace(page_key(page.table_id, page.pagenum), log->get_lsn());
+            }
+            continue;
+        }
         losers[log->get_trx_id()] = log->get_lsn();
+        if (log->get_type() == LOG_UPDATE || log->get_type() == LOG_COMPENSATE) {
+            open_log_table(log->get_table_id(), opened_tables);
+            dirty_pages.emplace(page_key(log->get_table_id(), log->get_pagenum()), log->get_lsn());
+        }
         if (log->get_type() == LOG_COMMIT || log->get_type() == LOG_ROLLBACK) {
             winners.insert(log->get_trx_id());
             losers.erase(log->get_trx_id());
         }
-        next_lsn += log->get_log_size();
-
-        delete log;
     }
     fprintf(logmsg_file, "[ANALYSIS] Analysis success. Winner: ");
     for (auto it = winners.begin();it != winners.end();) {
@@ -253,15 +1488,21 @@ void recover_main(char* logmsg_path, int flag, int log_num) {
     // Redo Pass
     fprintf(logmsg_file, "[REDO] Redo pass start\n");
 
-    rewind(log_file);
+    std::vector<redo_queue_t> redo_queues(REDO_THREADS > 1 ? REDO_THREADS : 0);
+    for (redo_queue_t& queue : redo_queues) {
+        queue.index = &queue - redo_queues.data();
+        pthread_mutex_init(&queue.latch, NULL);
+        pthread_cond_init(&queue.cond, NULL);
+        queue.closed = false;
+        queue.logmsg_file = logmsg_file;
+        pthread_create(&queue.worker, NULL, redo_worker_main, &queue);
+    }
     int redo = 0;
-    while (flag != 1 || redo < log_num) {
+    for (uint64_t lsn = master_record.redo_lsn; lsn < log_map.end && (flag != 1 || redo < log_num);) {
         redo++;
-        int sz;
-        if (fread(&sz, sizeof(int), 1, log_file) != 1) break;
-        log_entry_t* log = new log_entry_t(sz);
-        fseek(log_file, -sizeof(int), SEEK_CUR);
-        fread(log->data, 1, sz, log_file);
+        log_entry_t entry(log_map_at(lsn));
+        log_entry_t* log = &entry;
+        lsn += log->get_log_size();
 
 
         // if (log->get_type() == LOG_BEGIN) {
@@ -282,27 +1523,47 @@ void recover_main(char* logmsg_path, int flag, int log_num) {
                 fprintf(logmsg_file, "LSN %lu [CLR] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
             }
             int64_t table_id = log->get_table_id();
-            if (opened_tables.find(table_id) == opened_tables.end()) {
-                opened_tables.insert(table_id);
-                std::string filename = "DATA";
-                filename += std::to_string(table_id);
-                open_table(const_cast<char*>(filename.c_str()));
-            }
+            open_log_table(table_id, opened_tables);
 
-            control_block_t* ctrl_block = buf_read_page(table_id, log->get_pagenum());
-            if (PageIO::BPT::get_page_lsn(ctrl_block->frame) < log->get_lsn()) {
-                fprintf(logmsg_file, "LSN %lu [UPDATE] Transaction id %d redo apply\n", log->get_lsn(), log->get_trx_id());
-                PageIO::BPT::set_page_lsn(ctrl_block->frame, log->get_lsn());
-                char* buffer = new char[log->get_length()];
-                log->get_new_image(buffer);
-                ctrl_block->frame->set_data(const_cast<const char*>(buffer), log->get_offset(), log->get_length());
-                buf_return_ctrl_block(&ctrl_block, 1);
-                delete[] buffer;
-            } else {
+            // Pages that were clean, or got written back after this record,
+            // are skipped without reading them
+            auto page = dirty_pages.find(page_key(table_id, log->get_pagenum()));
+            if (page == dirty_pages.end() || log->get_lsn() < page->second) {
                 if (log->get_type() == LOG_UPDATE) {
                     fprintf(logmsg_file, "LSN %lu [COONSIDER-REDO] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
                 }
-                buf_return_ctrl_block(&ctrl_block);
+                continue;
+            }
+
+            if (REDO_THREADS <= 1) {
+                redo_apply(log, logmsg_file);
+                continue;
+            }
+            // Read the page while the records ahead of it are applied
+            buf_prefetch_page(table_id, log->get_pagenum());
+            redo_push(&redo_queues[redo_worker_of(table_id, log->get_pagenum())], log->data);
+            continue;
+        } else if (log->get_type() == LOG_SMO) {
+            std::vector<bool> workers(REDO_THREADS);
+            bool any = false;
+            for (const smo_page_t& page : smo_get_pages(*log)) {
+                open_log_table(page.table_id, opened_tables);
+                auto dirty = dirty_pages.find(page_key(page.table_id, page.pagenum));
+                if (dirty == dirty_pages.end() || log->get_lsn() < dirty->second) continue;
+                if (REDO_THREADS > 1) {
+                    buf_prefetch_page(page.table_id, page.pagenum);
+                    workers[redo_worker_of(page.table_id, page.pagenum)] = true;
+                }
+                any = true;
+            }
+            if (!any) {
+                fprintf(logmsg_file, "LSN %lu [SMO] skipped\n", log->get_lsn());
+            } else if (REDO_THREADS <= 1) {
+                redo_apply_smo(log, logmsg_file, -1);
+            } else {
+                for (int i = 0; i < REDO_THREADS; i++) {
+                    if (workers[i]) redo_push(&redo_queues[i], log->data);
+                }
             }
         } else if (log->get_type() == LOG_BEGIN) {
             fprintf(logmsg_file, "LSN %lu [BEGIN] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
@@ -312,15 +1573,26 @@ void recover_main(char* logmsg_path, int flag, int log_num) {
             fprintf(logmsg_file, "LSN %lu [ROLLBACK] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
         } else if (log->get_type() == LOG_COMPENSATE) {
             fprintf(logmsg_file, "LSN %lu [CLR] next undo lsn %lu\n", log->get_lsn(), log->get_next_undo_lsn());
+        } else if (log->get_type() == LOG_CHECKPOINT) {
+            fprintf(logmsg_file, "LSN %lu [CHECKPOINT]\n", log->get_lsn());
         } else {
             fprintf(logmsg_file, "LSN %lu [UNKNOWN]\n", log->get_lsn());
         }
+    }
 
-        delete log;
+    for (redo_queue_t& queue : redo_queues) {
+        pthread_mutex_lock(&queue.latch);
+        queue.closed = true;
+        pthread_cond_broadcast(&queue.cond);
+        pthread_mutex_unlock(&queue.latch);
+        pthread_join(queue.worker, NULL);
+        pthread_mutex_destroy(&queue.latch);
+        pthread_cond_destroy(&queue.cond);
     }
 
     fprintf(logmsg_file, "[REDO] Redo pass end\n");
     // Redo Pass Done
+    log_map_close();
 
     if(flag == 1){
         log_flush();
@@ -330,76 +1602,28 @@ void recover_main(char* logmsg_path, int flag, int log_num) {
     // Undo Pass
     fprintf(logmsg_file, "[UNDO] Undo pass start\n");
 
-    int undo = 0;
-    while (losers.size() > 0 && (flag != 2 || undo < log_num)) {
-        undo++;
-        int next_trx;
-        uint64_t next_entry = 0;
-        for (auto& x : losers) {
-            if (next_entry < x.second) {
-                next_trx = x.first;
-                next_entry = x.second;
-            }
-            if (trx_table.find(x.first) == trx_table.end()) trx_resurrect(x.first, x.second);
-        }
-        fseek(log_file, next_entry, SEEK_SET);
-        int sz;
-        fread(&sz, sizeof(int), 1, log_file);
-        log_entry_t* log = new log_entry_t(sz);
-        fseek(log_file, -sizeof(int), SEEK_CUR);
-        fread(log->data, 1, sz, log_file);
-        
-        if(log->get_type() == LOG_COMPENSATE){
-            fprintf(logmsg_file, "LSN %lu [CLR] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
-            losers[log->get_trx_id()] = log->get_next_undo_lsn();
-        }
-
-        if (log->get_type() == LOG_UPDATE) {
-            control_block_t* ctrl_block = buf_read_page(log->get_table_id(), log->get_pagenum());
-            if (PageIO::BPT::get_page_lsn(ctrl_block->frame) >= log->get_lsn()) {
-                fprintf(logmsg_file, "LSN %lu [UPDATE] Transaction id %d undo apply\n", log->get_lsn(), log->get_trx_id());
-                
-                int length = log->get_length();
-                char* old = new char[length];
-                log->get_old_image(old);
-                char* new_ = new char[length];
-                log->get_new_image(new_);
-                log_entry_t* new_log = create_compensate_log(log->get_trx_id(), log->get_table_id(), log->get_pagenum(), log->get_offset(), log->get_length(), new_, old, log->get_prev_lsn());
-                uint64_t new_lsn = add_to_log_buffer(new_log);
-
-                PageIO::BPT::set_page_lsn(ctrl_block->frame, new_lsn);
-                ctrl_block->frame->set_data(const_cast<const char*>(old), log->get_offset(), length);
-                buf_return_ctrl_block(&ctrl_block, 1);
-                delete[] old, new_;
-            } else {
-                buf_return_ctrl_block(&ctrl_block);
-            }
-            losers[log->get_trx_id()] = log->get_prev_lsn();
-        } else if (log->get_type() == LOG_BEGIN) {
-            fprintf(logmsg_file, "LSN %lu [BEGIN] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
-            log_entry_t* entry = create_rollback_log(log->get_trx_id());
-            uint64_t lsn = add_to_log_buffer(entry);
-            losers[log->get_trx_id()] = lsn;
-            trx_remove(log->get_trx_id());
-            losers.erase(log->get_trx_id());
-        } else if (log->get_type() == LOG_COMMIT) {
-            fprintf(logmsg_file, "LSN %lu [COMMIT] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
-        } else if (log->get_type() == LOG_ROLLBACK) {
-            fprintf(logmsg_file, "LSN %lu [ROLLBACK] Transaction id %d\n", log->get_lsn(), log->get_trx_id());
-        } else {
-            fprintf(logmsg_file, "LSN %lu [UNKNOWN]\n", log->get_lsn());
-        }
-
-        delete log;
-
-
+    // Losers are independent, so they are spread over the undo workers.
+    // A crash test stopping after log_num records undoes in one thread.
+    undo_pass_t* pass = new undo_pass_t();
+    int num_workers = flag == 2 ? 1 : UNDO_THREADS;
+    pass->workers.resize(std::max(1, std::min<int>(num_workers, losers.size())));
+    pass->budget = flag == 2 ? log_num : INT32_MAX;
+    pass->logmsg_file = logmsg_file;
+    pass->checkpoint = flag == 0 || flag == RECOVER_INSTANT;
+    int next_worker = 0;
+    undo_worker_t reader;
+    for (auto& x : losers) {
+        trx_resurrect(x.first, x.second);
+        if (flag == RECOVER_INSTANT) undo_relock(x.first, x.second, &reader, opened_tables);
+        undo_worker_t& worker = pass->workers[next_worker++ % pass->workers.size()];
+        worker.next_undo.push(std::make_pair(x.second, x.first));
     }
 
-    log_flush();
-
-    fprintf(logmsg_file, "[UNDO] Undo pass end\n");
-    // Undo Pass Done
-
-    fflush(logmsg_file);
-
-}
\ No newline at end of file
+    if (flag == RECOVER_INSTANT) {
+        fflush(logmsg_file);
+        undo_running = true;
+        pthread_create(&undo_thread, NULL, undo_pass_main, pass);
+        return;
+    }
+    undo_pass_main(pass);
+}
@@ -1,87 +1,73 @@
 #include "trx.h"
 #include "recovery.h"
 #include "buffer.h"
+#include <algorithm>
 #define DEBUG_MODE 0
 
 #define LOCK_MODE_EXCLUSIVE 1
 #define LOCK_MODE_SHARED 0
 
-int trx_id = 1;
+std::atomic<int> trx_id(1);
 
-pthread_mutex_t trx_table_latch;
+int deadlock_policy = DEADLOCK_DETECT;
 
-std::unordered_map<int, trx_entry_t*> trx_table;
+trx_table_shard_t trx_table[TRX_TABLE_SHARDS];
 
-bool conflict_exists(hash_table_entry_t* list, lock_t* lock) {
-    lock_t* curr = list->head;
-    while (curr != nullptr) {
-        if (curr == lock) return false;
-        if (curr->trx_id != lock->trx_id && (curr->bitmap & lock->bitmap) != 0 && (lock->lock_mode | curr->lock_mode) == 1) {
-            #if DEBUG_MODE
-            std::cout << "[DEBUG] conflict! " << curr->lock_mode << ", " << lock->lock_mode << ", " << curr->record_id << ", " << curr->trx_id << ", " << lock->trx_id << std::endl;
-            #endif
-            return true;
-        }
-        curr = curr->next;
-    }
-    return false;
+std::atomic<int> active_trx_count[ACTIVE_TRX_RING];
+
+// Only the thread running a transaction ends it, and trx_ids are not
+// reused, so a thread can keep the entry of its transaction around
+thread_local int cached_trx_id = 0;
+thread_local trx_entry_t* cached_trx = nullptr;
+
+static trx_table_shard_t* get_shard(int trx_id) {
+    return &trx_table[trx_id % TRX_TABLE_SHARDS];
 }
 
-void update_wait_for_graph(hash_table_entry_t* list, lock_t* lock) {
-    lock_t* cur = lock->prev;
-    while (cur != nullptr) {
-        if ((cur->bitmap & lock->bitmap) == 0) {
-            cur = cur->prev;
-            continue;
-        }
+// Latch order: trx_table shard, trx_latch, lock table partition, wait-for graph
 
-        if (cur->lock_mode == LOCK_MODE_EXCLUSIVE) {
-            if (cur->trx_id != lock->trx_id) {
-                trx_table[lock->trx_id]->wait_for.insert(cur->trx_id);
-            }
-            break;
-        } else if (lock->lock_mode == LOCK_MODE_EXCLUSIVE) {
-            if (cur->trx_id != lock->trx_id) {
-                trx_table[lock->trx_id]->wait_for.insert(cur->trx_id);
+// Transactions whose locks ahead of this one conflict with it
+std::vector<int> get_blockers(hash_table_entry_t* list, lock_t* lock) {
+    std::vector<int> blockers;
+    for (lock_t* curr = list->head; curr != nullptr && curr != lock; curr = curr->next) {
+        if (curr->trx_id != lock->trx_id && (curr->bitmap & lock->bitmap).any() && (lock->lock_mode | curr->lock_mode) == 1) {
+            if (std::find(blockers.begin(), blockers.end(), curr->trx_id) == blockers.end()) {
+                blockers.push_back(curr->trx_id);
             }
         }
-        cur = cur->prev;
     }
+    return blockers;
 }
 
-bool detect_deadlock(int trx_id) {
-    std::set<int> visited;
-    visited.insert(trx_id);
-
-    std::stack<std::pair<int, int>> dfs_stack;
-    dfs_stack.push({ trx_id,trx_id });
-    while (dfs_stack.size() > 0) {
-        int par_trx_id = dfs_stack.top().first;
-        int curr_trx_id = dfs_stack.top().second;
-        dfs_stack.pop();
-
-        trx_entry_t* par_trx = trx_table[par_trx_id];
-        trx_entry_t* curr_trx = trx_table[curr_trx_id];
-
-        if (par_trx == nullptr) continue;
+// Work thrown away by aborting trx: records to undo and locks held
+static size_t trx_cost(trx_entry_t* trx) {
+    return trx->logs.size() * 4 + trx->locks.size() + trx->fast_locks.size();
+}
 
-        if (curr_trx == nullptr) {
-            par_trx->wait_for.erase(curr_trx_id);
-            continue;
+// Make trx abort at its next wait, waking it up if it is waiting now.
+// The flag is set before the partition latch is taken, and trx_sleep
+// checks it under that latch, so the wake up can't be missed.
+void request_abort(int trx_id) {
+    trx_table_shard_t* shard = get_shard(trx_id);
+    pthread_mutex_lock(&shard->latch);
+
+    auto it = shard->entries.find(trx_id);
+    if (it != shard->entries.end() && !it->second->abort_requested.exchange(true)) {
+        trx_entry_t* trx = it->second;
+        pthread_mutex_lock(&trx->trx_latch);
+        if (trx->waiting_lock != nullptr) {
+            pthread_mutex_t* latch = get_entry_latch(trx->waiting_lock->sentinel);
+            pthread_mutex_lock(latch);
+            pthread_cond_signal(&trx->waiting_lock->lock_table_cond);
+            pthread_mutex_unlock(latch);
         }
-
-        if (par_trx_id != curr_trx_id && trx_id == curr_trx_id) return true;
-
-        if (par_trx_id != curr_trx_id && visited.find(curr_trx_id) != visited.end()) continue;
-
-        visited.insert(curr_trx_id);
-
-        for (auto it = curr_trx->wait_for.begin(); it != curr_trx->wait_for.end();it++) dfs_stack.push({ curr_trx_id,*it });
+        pthread_mutex_unlock(&trx->trx_latch);
     }
 
-    return false;
+    pthread_mutex_unlock(&shard->latch);
 }
 
+// Called with trx_latch held
 void release_locks(trx_entry_t* trx) {
     lock_t* lock = trx->lock;
     while (lock != nullptr) {
@@ -89,279 +75,405 @@ void release_locks(trx_entry_t* trx) {
         lock_release(lock);
         lock = tmp;
     }
+    for (auto const& ref : trx->fast_locks) {
+        lock_release_fast(ref, trx->trx_id);
+    }
+    trx->lock = nullptr;
     trx->locks.clear();
+    trx->fast_locks.clear();
 }
 
-void add_to_trx_list(trx_entry_t *trx, hash_table_entry_t *list, lock_t* lock){
+// Called with trx_latch held
+void add_to_trx_list(trx_entry_t *trx, lock_t* lock){
     // std::cout << "[DEBUG] lock, trx = " << lock << ", " << trx << std::endl;
     lock->trx_next = trx->lock;
     trx->lock = lock;
 
     trx->locks[{ {lock->sentinel->table_id, lock->sentinel->page_id}, { lock->record_id, lock->lock_mode }}] = lock;
-    
-    update_wait_for_graph(list, lock);
 }
 
+// Undo images are only touched by the thread running the transaction
 std::optional<std::pair<uint16_t, char*>> trx_find_log(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id) {
-    pthread_mutex_lock(&trx_table_latch);
+    trx_entry_t* trx = trx_get_entry(trx_id);
 
-    auto it = trx_table[trx_id]->logs.find({ {table_id, pagenum}, key });
-    if (it == trx_table[trx_id]->logs.end()) {
-        pthread_mutex_unlock(&trx_table_latch);
+    auto it = trx->logs.find({ {table_id, pagenum}, key });
+    if (it == trx->logs.end()) {
         return std::nullopt;
     }
 
-    auto p = it->second;
-
-    pthread_mutex_unlock(&trx_table_latch);
-    return std::optional<std::pair<uint16_t, char*>>(p);
+    return std::optional<std::pair<uint16_t, char*>>(it->second);
 }
 
 void trx_add_log(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, std::pair<uint16_t, char*> log) {
-    pthread_mutex_lock(&trx_table_latch);
-
-    trx_table[trx_id]->logs[{ {table_id, pagenum}, key}] = log;
-
-    pthread_mutex_unlock(&trx_table_latch);
+    trx_entry_t* trx = trx_get_entry(trx_id);
+    trx->logs[{ {table_id, pagenum}, key}] = log;
 }
 
 lock_t* trx_get_lock(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, int lock_mode) {
-    pthread_mutex_lock(&trx_table_latch);
+    trx_entry_t* trx = trx_get_entry(trx_id);
+    if (trx == nullptr) return nullptr;
 
     lock_t* lock = nullptr;
-    trx_entry_t* trx = trx_table[trx_id];
-    if (trx != nullptr) {
-        auto it = trx->locks.find({ {table_id, pagenum}, {key, 1} });
-        if (it == trx->locks.end() && lock_mode == LOCK_MODE_SHARED) {
-            it = trx->locks.find({ {table_id, pagenum}, {key, 0} });
-        }
-        if (it != trx->locks.end()) {
-            lock = it->second;
-        }
+    pthread_mutex_lock(&trx->trx_latch);
+    auto it = trx->locks.find({ {table_id, pagenum}, {key, 1} });
+    if (it == trx->locks.end() && lock_mode == LOCK_MODE_SHARED) {
+        it = trx->locks.find({ {table_id, pagenum}, {key, 0} });
     }
-
-    pthread_mutex_unlock(&trx_table_latch);
+    if (it != trx->locks.end()) {
+        lock = it->second;
+    }
+    pthread_mutex_unlock(&trx->trx_latch);
     return lock;
 }
-void trx_add_to_locks(int trx_id, int64_t key, lock_t* lock){
-    pthread_mutex_lock(&trx_table_latch);
 
-    trx_table[trx_id]->locks[{ {lock->sentinel->table_id, lock->sentinel->page_id}, { key, lock->lock_mode }}] = lock;
+void trx_add_to_locks(int trx_id, int64_t key, lock_t* lock){
+    trx_entry_t* trx = trx_get_entry(trx_id);
 
-    pthread_mutex_unlock(&trx_table_latch);
+    pthread_mutex_lock(&trx->trx_latch);
+    trx->locks[{ {lock->sentinel->table_id, lock->sentinel->page_id}, { key, lock->lock_mode }}] = lock;
+    pthread_mutex_unlock(&trx->trx_latch);
 }
 
 void trx_add_to_locks(int trx_id, lock_t* lock){
-    pthread_mutex_lock(&trx_table_latch);
+    trx_add_to_locks(trx_id, lock->record_id, lock);
+}
 
-    trx_table[trx_id]->locks[{ {lock->sentinel->table_id, lock->sentinel->page_id}, { lock->record_id, lock->lock_mode }}] = lock;
+// The entry may only be used after the shard latch is released by the
+// thread running the transaction
+trx_entry_t* trx_check_active(int trx_id) {
+    trx_table_shard_t* shard = get_shard(trx_id);
+    trx_entry_t* trx = nullptr;
 
-    pthread_mutex_unlock(&trx_table_latch);
+    pthread_mutex_lock(&shard->latch);
+    auto it = shard->entries.find(trx_id);
+    if (it != shard->entries.end()) {
+        trx = it->second;
+    }
+    pthread_mutex_unlock(&shard->latch);
+    return trx;
 }
 
-trx_entry_t* trx_check_active(int trx_id) {
-    auto it = trx_table.find(trx_id);
-    if (it != trx_table.end()) {
-        return it->second;
+// Entry of a transaction run by the calling thread
+trx_entry_t* trx_get_entry(int trx_id) {
+    if (cached_trx_id == trx_id) return cached_trx;
+
+    trx_entry_t* trx = trx_check_active(trx_id);
+
+    if (trx != nullptr) {
+        cached_trx_id = trx_id;
+        cached_trx = trx;
     }
+    return trx;
+}
 
-    return nullptr;
+// false only if trx_id is certainly not active
+bool trx_maybe_active(int trx_id) {
+    return active_trx_count[trx_id % ACTIVE_TRX_RING].load() != 0;
 }
 
-int trx_implicit_to_explicit(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_id, int trx_written){
-    pthread_mutex_lock(&trx_table_latch);
-    trx_entry_t* trx = trx_check_active(trx_written);
+static void trx_insert(trx_entry_t* trx) {
+    trx_table_shard_t* shard = get_shard(trx->trx_id);
+    active_trx_count[trx->trx_id % ACTIVE_TRX_RING]++;
+    pthread_mutex_lock(&shard->latch);
+    shard->entries[trx->trx_id] = trx;
+    pthread_mutex_unlock(&shard->latch);
+}
 
-    if (trx != nullptr) {
-        // implicit to explicit
-        lock_t* lock = lock_acquire(table_id, pagenum, key, trx_written, 1);
+static bool trx_erase(int trx_id) {
+    trx_table_shard_t* shard = get_shard(trx_id);
+    pthread_mutex_lock(&shard->latch);
+    bool erased = shard->entries.erase(trx_id) > 0;
+    pthread_mutex_unlock(&shard->latch);
+    return erased;
+}
 
-        if (lock == nullptr) {
-            pthread_mutex_unlock(&trx_table_latch);
-            return -1;
-        }
+static void trx_forget(int trx_id) {
+    active_trx_count[trx_id % ACTIVE_TRX_RING]--;
+    if (cached_trx_id == trx_id) {
+        cached_trx_id = 0;
+        cached_trx = nullptr;
+    }
+}
 
-        add_to_trx_list(trx, lock->sentinel, lock);
+// Leaves the table first, so that no one can add an implicit lock's
+// explicit form after the locks are released
+static void trx_end(trx_entry_t* trx) {
+    int id = trx->trx_id;
+    trx_erase(id);
 
-        pthread_mutex_unlock(&trx_table_latch);
-        return 0;
-    } else {
-        pthread_mutex_unlock(&trx_table_latch);
+    pthread_mutex_lock(&trx->trx_latch);
+    release_locks(trx);
+    pthread_mutex_unlock(&trx->trx_latch);
+
+    pthread_mutex_destroy(&trx->trx_latch);
+    delete trx;
+    trx_forget(id);
+}
+
+static trx_entry_t* trx_create(int id) {
+    trx_entry_t* trx_entry = new trx_entry_t();
+    trx_entry->trx_id = id;
+    trx_entry->lock = nullptr;
+    trx_entry->waiting_lock = nullptr;
+    trx_entry->abort_requested = false;
+    trx_entry->first_lsn = 0;
+    trx_entry->last_lsn = 0;
+    pthread_mutex_init(&trx_entry->trx_latch, NULL);
+    return trx_entry;
+}
+
+int trx_implicit_to_explicit(int64_t table_id, pagenum_t pagenum, int64_t key, int trx_written){
+    // Hold the shard latch so that the writer can't end in between
+    trx_table_shard_t* shard = get_shard(trx_written);
+    pthread_mutex_lock(&shard->latch);
+
+    auto it = shard->entries.find(trx_written);
+    if (it == shard->entries.end()) {
+        pthread_mutex_unlock(&shard->latch);
         return -1;
     }
+
+    trx_entry_t* trx = it->second;
+    pthread_mutex_lock(&trx->trx_latch);
+
+    // implicit to explicit
+    lock_t* lock = lock_acquire(table_id, pagenum, key, trx_written, 1);
+    if (lock != nullptr) {
+        add_to_trx_list(trx, lock);
+    }
+
+    pthread_mutex_unlock(&trx->trx_latch);
+    pthread_mutex_unlock(&shard->latch);
+    return lock == nullptr ? -1 : 0;
 }
 
 // return 0 if success, 1 for fail and trx has to abort, 2 for anomaly, 3 for sleep
 int trx_acquire(int trx_id, lock_t* lock) {
-    pthread_mutex_lock(&trx_table_latch);
+    trx_entry_t* trx_entry = trx_get_entry(trx_id);
 
-    auto it = trx_table.find(trx_id);
-    // std::cout << "trx_entry == nullptr: " << (it == trx_table.end()) << " trx_id = " << trx_id << std::endl;
-
-    if (it == trx_table.end()) {
-        pthread_mutex_unlock(&trx_table_latch);
+    if (trx_entry == nullptr) {
         return 2;
     }
 
     #if DEBUG_MODE
     // std::cout << "[DEBUG] Found trx with trx_id = " << trx_id << ", record_id = " << key << std::endl;
     #endif
-    trx_entry_t* trx_entry = it->second;
 
-    // TODO: change this to a proper list
-    
     hash_table_entry_t* list = lock->sentinel;
 
-    add_to_trx_list(trx_entry, list, lock);
+    pthread_mutex_lock(&trx_entry->trx_latch);
+    add_to_trx_list(trx_entry, lock);
+    size_t cost = trx_cost(trx_entry);
+    pthread_mutex_unlock(&trx_entry->trx_latch);
 
-    if (detect_deadlock(lock->trx_id)) {
-        #if DEBUG_MODE
-        std::cout << "[DEBUG] deadlock!" << std::endl;
-        #endif
-        pthread_mutex_unlock(&trx_table_latch);
+    if (trx_entry->abort_requested) {
         return 1;
     }
 
-    if (conflict_exists(list, lock)) {
-        #if DEBUG_MODE
-        std::cout << "[DEBUG] sleep!" << std::endl;
-        #endif
-        // the latch will be released in trx_sleep
-        return 3;
+    pthread_mutex_lock(get_entry_latch(list));
+    std::vector<int> blockers = get_blockers(list, lock);
+    pthread_mutex_unlock(get_entry_latch(list));
+
+    if (blockers.empty()) {
+        return 0;
     }
-    pthread_mutex_unlock(&trx_table_latch);
-    return 0;
+
+    if (deadlock_policy == DEADLOCK_WAIT_DIE) {
+        for (int blocker : blockers) {
+            if (blocker < trx_id) return 1;
+        }
+    } else if (deadlock_policy == DEADLOCK_WOUND_WAIT) {
+        for (int blocker : blockers) {
+            if (blocker > trx_id) request_abort(blocker);
+        }
+    } else {
+        // Several cycles may go through trx, break all of them. A victim's
+        // edges are dropped right away, it will only wake up to abort.
+        WaitForGraph::set_waits(trx_id, blockers, cost);
+        for (std::vector<int> cycle = WaitForGraph::find_cycle(trx_id); !cycle.empty(); cycle = WaitForGraph::find_cycle(trx_id)) {
+            int victim = WaitForGraph::choose_victim(cycle);
+            #if DEBUG_MODE
+            std::cout << "[DEBUG] deadlock! victim = " << victim << std::endl;
+            #endif
+            if (victim == 0) break;
+            WaitForGraph::clear(victim);
+            if (victim == trx_id) return 1;
+            request_abort(victim);
+        }
+    }
+
+    pthread_mutex_lock(&trx_entry->trx_latch);
+    trx_entry->waiting_lock = lock;
+    pthread_mutex_unlock(&trx_entry->trx_latch);
+
+    #if DEBUG_MODE
+    std::cout << "[DEBUG] sleep!" << std::endl;
+    #endif
+    return 3;
 }
 
 int trx_abort(int trx_id) {
-    pthread_mutex_lock(&trx_table_latch);
     #if DEBUG_MODE
     std::cout << "[ABORT] Aborted Start " << trx_id << std::endl;
     #endif
 
-    auto it = trx_table.find(trx_id);
-    if (it != trx_table.end()) {
-        trx_entry_t* trx_entry = it->second;
-        
-        pthread_mutex_unlock(&trx_table_latch);
-        
-        for (auto x : trx_entry->logs) {
-            auto key = x.first;
-            auto log = x.second;
-            #if DEBUG_MODE
-            std::cout << "[ABORT] undoing page = " << key.first.second << std::endl;
-            #endif
-
-            control_block_t* ctrl_block = buf_read_page(key.first.first, key.first.second);
-            slot_t slot = PageIO::BPT::LeafPage::get_nth_slot(ctrl_block->frame, key.second);
-
-            char * original_value = new char[slot.get_size()];
-            ctrl_block->frame->get_data(original_value, slot.get_offset(), slot.get_size());
+    trx_entry_t* trx_entry = trx_get_entry(trx_id);
+    if (trx_entry == nullptr) return 0;
 
-            log_entry_t* log_ = create_update_log(trx_id, key.first.first, key.first.second, slot.get_offset(), slot.get_size(), const_cast<const char*>(original_value), const_cast<const char*>(log.second));
-            uint64_t lsn = add_to_log_buffer(log_);
-
-            PageIO::BPT::set_page_lsn(ctrl_block->frame, lsn);
-            ctrl_block->frame->set_data(log.second, slot.get_offset(), log.first);
-            buf_return_ctrl_block(&ctrl_block, 1);
-        }
-        
-        pthread_mutex_lock(&trx_table_latch);
-        
+    smo_shared_begin();
+    for (auto x : trx_entry->logs) {
+        auto key = x.first;
+        auto log = x.second;
         #if DEBUG_MODE
-        std::cout << "[ABORT] finished undo, now releasing locks" << std::endl;
+        std::cout << "[ABORT] undoing page = " << key.first.second << std::endl;
         #endif
 
-        release_locks(trx_entry);
+        control_block_t* ctrl_block = buf_read_page(key.first.first, key.first.second);
+        if (ctrl_block->corrupted) {
+            std::cout << "[ERROR] Abort of transaction " << trx_id << " skipped corrupted page " << key.first.second << std::endl;
+            buf_return_ctrl_block(&ctrl_block);
+            continue;
+        }
+        slot_t slot = PageIO::BPT::LeafPage::get_nth_slot(ctrl_block->frame, key.second);
 
-        
-        #if DEBUG_MODE
-        std::cout << "[ABORT] DONE" << std::endl;
-        #endif
+        char * original_value = new char[slot.get_size()];
+        ctrl_block->frame->get_data(original_value, slot.get_offset(), slot.get_size());
 
-        log_entry_t *log = create_rollback_log(trx_id);
-        add_to_log_buffer(log);
-        log_flush();
+        log_entry_t log_ = create_slot_update_log(trx_id, key.first.first, key.first.second, slot.get_key(), slot.get_offset(), slot.get_size(), const_cast<const char*>(original_value), const_cast<const char*>(log.second));
+        uint64_t lsn = add_to_log_buffer(log_);
 
-        delete trx_entry;
-        trx_table.erase(trx_id);
+        PageIO::BPT::set_page_lsn(ctrl_block->frame, lsn);
+        ctrl_block->frame->set_data(log.second, slot.get_offset(), log.first);
+        buf_return_ctrl_block(&ctrl_block, 1);
     }
+    smo_shared_end();
+
+    #if DEBUG_MODE
+    std::cout << "[ABORT] finished undo, now releasing locks" << std::endl;
+    #endif
 
+    log_entry_t log = create_rollback_log(trx_id);
+    log_flush_until(add_to_log_buffer(log));
 
-    pthread_mutex_unlock(&trx_table_latch);
+    trx_end(trx_entry);
+
+    #if DEBUG_MODE
+    std::cout << "[ABORT] DONE" << std::endl;
+    #endif
     return 0;
 }
 
-void trx_sleep(int trx_id){
-    lock_t *lock = trx_table[trx_id]->lock;
-    pthread_cond_wait(&lock->lock_table_cond, &trx_table_latch);
-    pthread_mutex_unlock(&trx_table_latch);
+// Waits on the partition latch, under which locks are released and woken
+// up, so no wake up is lost between the check and the wait. Keeps waiting
+// on spurious wake ups.
+// Returns 1 if the trx was chosen as a deadlock victim or wounded and has
+// to abort.
+int trx_sleep(int trx_id){
+    trx_entry_t* trx = trx_get_entry(trx_id);
+
+    pthread_mutex_lock(&trx->trx_latch);
+    lock_t *lock = trx->waiting_lock;
+    size_t cost = trx_cost(trx);
+    pthread_mutex_unlock(&trx->trx_latch);
+
+    pthread_mutex_t* latch = get_entry_latch(lock->sentinel);
+    int aborted = 0;
+    pthread_mutex_lock(latch);
+    while (true) {
+        if (trx->abort_requested) {
+            aborted = 1;
+            break;
+        }
+        std::vector<int> blockers = get_blockers(lock->sentinel, lock);
+        if (blockers.empty()) break;
+        // Blockers only ever leave the queue ahead of us, no new cycle
+        if (deadlock_policy == DEADLOCK_DETECT) WaitForGraph::set_waits(trx_id, blockers, cost);
+        pthread_cond_wait(&lock->lock_table_cond, latch);
+    }
+    pthread_mutex_unlock(latch);
+
+    if (deadlock_policy == DEADLOCK_DETECT) WaitForGraph::clear(trx_id);
+    pthread_mutex_lock(&trx->trx_latch);
+    trx->waiting_lock = nullptr;
+    pthread_mutex_unlock(&trx->trx_latch);
+    return aborted;
 }
 
-int trx_init() {
-    int err = pthread_mutex_init(&trx_table_latch, NULL);
+int trx_init(int policy) {
+    deadlock_policy = policy;
+    int err = 0;
+    for (int i = 0; i < TRX_TABLE_SHARDS; i++) {
+        err += pthread_mutex_init(&trx_table[i].latch, NULL);
+    }
+    err += WaitForGraph::init();
     return err;
 }
 
 int trx_shutdown() {
-    int err = pthread_mutex_destroy(&trx_table_latch);
+    int err = 0;
+    for (int i = 0; i < TRX_TABLE_SHARDS; i++) {
+        err += pthread_mutex_destroy(&trx_table[i].latch);
+    }
+    err += WaitForGraph::shutdown();
     return err;
 }
 
 int trx_begin(void) {
-    pthread_mutex_lock(&trx_table_latch);
+    trx_entry_t* trx_entry = trx_create(trx_id++);
 
     #if DEBUG_MODE
-    std::cout << "[DEBUG] trx_begin trx_id = " << trx_id << std::endl;
+    std::cout << "[DEBUG] trx_begin trx_id = " << trx_entry->trx_id << std::endl;
     #endif
-    trx_entry_t* trx_entry = new trx_entry_t();
-    if (trx_entry != nullptr) {
-        trx_entry->trx_id = trx_id++;
-        trx_entry->lock = nullptr;
-        trx_table[trx_entry->trx_id] = trx_entry;
-        log_entry_t *log = create_begin_log(trx_entry->trx_id);
-        uint64_t lsn = add_to_log_buffer(log);
-        pthread_mutex_unlock(&trx_table_latch);
-        return trx_entry->trx_id;
-    }
+    trx_insert(trx_entry);
 
-    pthread_mutex_unlock(&trx_table_latch);
-    return 0;
+    log_entry_t log = create_begin_log(trx_entry->trx_id);
+    add_to_log_buffer(log);
+    return trx_entry->trx_id;
 }
-void trx_resurrect(int trx_id, uint64_t lsn){
-    pthread_mutex_lock(&trx_table_latch);
-    trx_entry_t* trx_entry = new trx_entry_t();
-    trx_entry->trx_id = trx_id++;
-    trx_entry->lock = nullptr;
+
+void trx_resurrect(int id, uint64_t lsn){
+    trx_entry_t* trx_entry = trx_create(id);
     trx_entry->last_lsn = lsn;
-    trx_table[trx_entry->trx_id] = trx_entry;
-    pthread_mutex_unlock(&trx_table_latch);
+
+    // New transactions must not reuse the ids of the ones being undone
+    int next = trx_id.load();
+    while (next <= id && !trx_id.compare_exchange_weak(next, id + 1));
+
+    trx_insert(trx_entry);
 }
 
+// A loser is done rolling back, its locks may have waiters since an
+// instant restart
 void trx_remove(int trx_id){
-    pthread_mutex_lock(&trx_table_latch);
-    trx_table.erase(trx_id);
-    pthread_mutex_unlock(&trx_table_latch);
+    trx_entry_t* trx = trx_check_active(trx_id);
+    if (trx != nullptr) trx_end(trx);
+}
+
+// Active transaction table for a checkpoint
+std::vector<att_entry_t> trx_snapshot() {
+    std::vector<att_entry_t> att;
+    for (int i = 0; i < TRX_TABLE_SHARDS; i++) {
+        pthread_mutex_lock(&trx_table[i].latch);
+        for (auto& entry : trx_table[i].entries) {
+            att.push_back({ entry.first, entry.second->first_lsn, entry.second->last_lsn });
+        }
+        pthread_mutex_unlock(&trx_table[i].latch);
+    }
+    return att;
 }
 
 int trx_commit(int trx_id) {
-    pthread_mutex_lock(&trx_table_latch);
     #if DEBUG_MODE
     std::cout << "[DEBUG] trx_commit trx_id = " << trx_id << std::endl;
     #endif
 
-    log_entry_t *log = create_commit_log(trx_id);
-    add_to_log_buffer(log);
-    log_flush();
+    trx_entry_t* trx_entry = trx_get_entry(trx_id);
+    if (trx_entry == nullptr) return 0;
 
-    auto it = trx_table.find(trx_id);
-    if (it != trx_table.end()) {
-        trx_entry_t* trx_entry = it->second;
-        release_locks(trx_entry);
+    // Waits for the log writer, which flushes concurrent commits together
+    log_entry_t log = create_commit_log(trx_id);
+    log_flush_until(add_to_log_buffer(log));
 
-        delete trx_entry;
-        trx_table.erase(it);
-    }
-    pthread_mutex_unlock(&trx_table_latch);
+    trx_end(trx_entry);
     return trx_id;
-}
\ No newline at end of file
+}
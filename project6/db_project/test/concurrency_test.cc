@@ -1,7 +1,11 @@
 #include "file.h"
 #include "mybpt.h"
 #include "trx.h"
+#include "recovery.h"
 #include <random>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 
 #include <gtest/gtest.h>
 #define BUF_SIZE 200
@@ -16,7 +20,7 @@ TEST(ConcurrencyCtrl, SingleThread) {
         std::cout << "[INFO] File 'DATA1' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA1");
+    int table_id = open_table((char*)"DATA1");
 
     int n = N;
 
@@ -81,7 +85,7 @@ TEST(ConcurrencyCtrl, SingleThreadRandom) {
         std::cout << "[INFO] File 'DATA2' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA2");
+    int table_id = open_table((char*)"DATA2");
 
     int n = N;
 
@@ -195,7 +199,7 @@ TEST(ConcurrencyCtrl, SLockOnlyTest) {
     }
 
     int *table_id = (int*)malloc(sizeof(int)); 
-    *table_id = open_table("DATA3");
+    *table_id = open_table((char*)"DATA3");
 
     int n = N;
 
@@ -267,7 +271,7 @@ TEST(ConcurrencyCtrl, XLockOnlyDisjointTest) {
         std::cout << "[INFO] File 'DATA4' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA4");
+    int table_id = open_table((char*)"DATA4");
 
     int n = N;
 
@@ -314,7 +318,7 @@ TEST(ConcurrencyCtrl, XLockOnlyDisjointTest) {
 TEST(ConcurrencyCtrl, XLockOnlyDisjointTestCheck) {
     EXPECT_EQ(init_db(BUF_SIZE), 0);
 
-    int table_id = open_table("DATA4");
+    int table_id = open_table((char*)"DATA4");
 
     int n = N;
     
@@ -371,7 +375,7 @@ TEST(ConcurrencyCtrl, XLockOnlyTest) {
         std::cout << "[INFO] File 'DATA5' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA5");
+    int table_id = open_table((char*)"DATA5");
 
     int n = N;
 
@@ -416,7 +420,7 @@ TEST(ConcurrencyCtrl, XLockOnlyTest) {
 
 TEST(ConcurrencyCtrl, XLockOnlyTestCheck) {
     EXPECT_EQ(init_db(BUF_SIZE), 0);
-    int table_id = open_table("DATA5");
+    int table_id = open_table((char*)"DATA5");
 
     int n = N;
     int last_trx = 0;
@@ -441,7 +445,7 @@ TEST(ConcurrencyCtrl, MixedLockTest) {
         std::cout << "[INFO] File 'DATA6' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA6");
+    int table_id = open_table((char*)"DATA6");
 
     int n = N;
 
@@ -482,7 +486,7 @@ TEST(ConcurrencyCtrl, MixedLockTest) {
 
 TEST(ConcurrencyCtrl, MixedLockTestCheck) {
     EXPECT_EQ(init_db(BUF_SIZE), 0);
-    int table_id = open_table("DATA6");
+    int table_id = open_table((char*)"DATA6");
 
     int n = N;
     int last_trx = 0;
@@ -545,7 +549,7 @@ TEST(ConcurrencyCtrl, DeadlockTest) {
         std::cout << "[INFO] File 'DATA7' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA7");
+    int table_id = open_table((char*)"DATA7");
 
     int n = N;
 
@@ -590,6 +594,8 @@ TEST(ConcurrencyCtrl, DeadlockTest) {
 }
 
 
+std::atomic<int> mixed_commits, mixed_aborts;
+
 void* deadlock_test_mixed(void* arg) {
     int trx_id = trx_begin();
     EXPECT_GT(trx_id, 0);
@@ -637,6 +643,8 @@ void* deadlock_test_mixed(void* arg) {
         }
     }
     if(!aborted) trx_commit(trx_id);
+    if(aborted) mixed_aborts++;
+    else mixed_commits++;
     std::cout << "[DEBUG] Thread " << trx_id << " done" << std::endl;
     return NULL;
 }
@@ -650,7 +658,7 @@ TEST(ConcurrencyCtrl, DeadlockTestMixed) {
         std::cout << "[INFO] File 'DATA8' already exists. Deleting it." << std::endl;
     }
 
-    int table_id = open_table("DATA8");
+    int table_id = open_table((char*)"DATA8");
 
     int n = N;
 
@@ -691,4 +699,310 @@ TEST(ConcurrencyCtrl, DeadlockTestMixed) {
     }
 
     EXPECT_EQ(shutdown_db(), 0);
-}
\ No newline at end of file
+}
+
+#define POLICY_KEYS 1000
+#define POLICY_TRXS 100
+
+struct policy_arg_t {
+    int table_id;
+    int seed;
+    int increments; // committed by this thread
+    int stride;     // the records are the keys stride, 2 * stride, ...
+};
+
+// Each record holds a counter. A trx reads and increments a few random
+// records, so transactions overlap on some records but not on all.
+void* policy_worker(void* arg) {
+    policy_arg_t* a = (policy_arg_t*)arg;
+    std::mt19937 gen(a->seed);
+    std::uniform_int_distribution<int> pick(1, POLICY_KEYS);
+
+    for (int t = 0; t < POLICY_TRXS; t++) {
+        int trx_id = trx_begin();
+        EXPECT_GT(trx_id, 0);
+
+        std::vector<int> keys;
+        while (keys.size() < 4) {
+            int key = pick(gen) * a->stride;
+            if (std::find(keys.begin(), keys.end(), key) == keys.end()) keys.push_back(key);
+        }
+
+        bool aborted = false;
+        for (int key : keys) {
+            char ret_val[112];
+            uint16_t val_size, old_val_size;
+            if (db_find(a->table_id, key, ret_val, &val_size, trx_id)) {
+                aborted = true;
+                break;
+            }
+            std::string data = std::to_string(std::stoi(std::string(ret_val, 10)) + 1);
+            data = std::string(10 - data.length(), '0') + data + std::string(ret_val + 10, val_size - 10);
+            if (db_update(a->table_id, key, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id)) {
+                aborted = true;
+                break;
+            }
+        }
+        if (aborted) {
+            mixed_aborts++;
+        } else {
+            trx_commit(trx_id);
+            mixed_commits++;
+            a->increments += keys.size();
+        }
+    }
+    return NULL;
+}
+
+// Short overlapping transactions under each deadlock policy. Aborted
+// ones are rolled back, so the counters add up to the committed work.
+TEST(ConcurrencyCtrl, DeadlockPolicyThroughput) {
+    int policies[3] = { DEADLOCK_DETECT, DEADLOCK_WAIT_DIE, DEADLOCK_WOUND_WAIT };
+    std::string names[3] = { "detect", "wait-die", "wound-wait" };
+
+    for (int p = 0; p < 3; p++) {
+        log_remove((char*)"plog");
+        std::remove("plogmsg");
+        EXPECT_EQ(init_db(BUF_SIZE, 0, 0, (char*)"plog", (char*)"plogmsg", policies[p]), 0);
+
+        std::string pathname = "DATA9_" + std::to_string(p);
+        std::remove(pathname.c_str());
+        int table_id = open_table(const_cast<char*>(pathname.c_str()));
+
+        for (int i = 1; i <= POLICY_KEYS; i++) {
+            std::string data = "00000000000123456789012345678901234567890123456789" + std::to_string(i);
+            int res = db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length());
+            EXPECT_EQ(res, 0);
+        }
+
+        mixed_commits = 0;
+        mixed_aborts = 0;
+
+        int m = 16;
+        pthread_t threads[m];
+        policy_arg_t args[m];
+        auto start = std::chrono::steady_clock::now();
+        for (int i = 0; i < m; i++) {
+            args[i] = { table_id, 2020011776 + i, 0, 1 };
+            pthread_create(&threads[i], NULL, policy_worker, &args[i]);
+        }
+        for (int i = 0; i < m; i++) {
+            pthread_join(threads[i], NULL);
+        }
+        double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        EXPECT_EQ(mixed_commits + mixed_aborts, m * POLICY_TRXS);
+        EXPECT_GT(mixed_commits, m * POLICY_TRXS / 4);
+        std::cout << "[INFO] " << names[p] << ": " << mixed_commits << " commits, " << mixed_aborts << " aborts in "
+            << elapsed << "s, " << mixed_commits / elapsed << " commits/s" << std::endl;
+
+        int increments = 0;
+        for (int i = 0; i < m; i++) increments += args[i].increments;
+        int total = 0;
+        for (int i = 1; i <= POLICY_KEYS; i++) {
+            char ret_val[112];
+            uint16_t val_size;
+            EXPECT_EQ(db_find(table_id, i, ret_val, &val_size), 0);
+            total += std::stoi(std::string(ret_val, 10));
+        }
+        EXPECT_EQ(total, increments);
+
+        EXPECT_EQ(shutdown_db(), 0);
+    }
+}
+
+struct inserter_arg_t {
+    int table_id;
+    int first;
+};
+
+void* inserter(void* arg) {
+    inserter_arg_t* a = (inserter_arg_t*)arg;
+    for (int key = a->first; key < 2 * POLICY_KEYS; key += 4) {
+        std::string data = "inserted-0123456789012345678901234567890123456789" + std::to_string(key);
+        EXPECT_EQ(db_insert(a->table_id, key, const_cast<char*>(data.c_str()), data.length()), 0);
+    }
+    return NULL;
+}
+
+// Inserts split the leaves and shift the slots of records that
+// transactions are updating. They wait for each other on the structure
+// modification latch, so no update is lost or lands on a moved record.
+TEST(ConcurrencyCtrl, InsertsBesideTransactions) {
+    log_remove((char*)"plog");
+    std::remove("plogmsg");
+    EXPECT_EQ(init_db(BUF_SIZE, 0, 0, (char*)"plog", (char*)"plogmsg"), 0);
+    std::remove("DATA10");
+    int table_id = open_table((char*)"DATA10");
+
+    for (int i = 2; i <= 2 * POLICY_KEYS; i += 2) {
+        std::string data = "00000000000123456789012345678901234567890123456789" + std::to_string(i);
+        EXPECT_EQ(db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length()), 0);
+    }
+
+    mixed_commits = 0;
+    mixed_aborts = 0;
+
+    int m = 8;
+    pthread_t threads[m], inserters[2];
+    policy_arg_t args[m];
+    inserter_arg_t inserter_args[2] = { { table_id, 1 }, { table_id, 3 } };
+    for (int i = 0; i < 2; i++) pthread_create(&inserters[i], NULL, inserter, &inserter_args[i]);
+    for (int i = 0; i < m; i++) {
+        args[i] = { table_id, 2021011776 + i, 0, 2 };
+        pthread_create(&threads[i], NULL, policy_worker, &args[i]);
+    }
+    for (int i = 0; i < m; i++) pthread_join(threads[i], NULL);
+    for (int i = 0; i < 2; i++) pthread_join(inserters[i], NULL);
+
+    EXPECT_EQ(mixed_commits + mixed_aborts, m * POLICY_TRXS);
+
+    int increments = 0;
+    for (int i = 0; i < m; i++) increments += args[i].increments;
+    int total = 0;
+    for (int i = 1; i <= 2 * POLICY_KEYS; i++) {
+        char ret_val[112];
+        uint16_t val_size;
+        ASSERT_EQ(db_find(table_id, i, ret_val, &val_size), 0) << "key " << i;
+        if (i % 2 == 0) total += std::stoi(std::string(ret_val, 10));
+        else EXPECT_EQ(std::string(ret_val, val_size), "inserted-0123456789012345678901234567890123456789" + std::to_string(i));
+    }
+    EXPECT_EQ(total, increments);
+
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// Lock table level tests, without a database
+#define LT_TABLE 7
+#define LT_PAGE 11
+
+// A fast S lock is turned into an explicit one ahead of the first queued
+// lock, and the fast path stays closed until the queue drains
+TEST(LockTable, FastToSlowConversion) {
+    init_lock_table();
+    std::vector<fast_lock_ref_t> fast1, fast3;
+    ASSERT_TRUE(lock_acquire_fast(LT_TABLE, LT_PAGE, 3, 1, fast1));
+    ASSERT_EQ(fast1.size(), 1);
+
+    lock_t* x = lock_acquire(LT_TABLE, LT_PAGE, 3, 2, LOCK_MODE_EXCLUSIVE);
+    hash_table_entry_t* list = x->sentinel;
+    EXPECT_TRUE(list->fast_header.load() & FAST_HEADER_SLOW);
+    ASSERT_NE(list->head, x);
+    EXPECT_EQ(list->head->trx_id, 1);
+    EXPECT_EQ(list->head->lock_mode, LOCK_MODE_SHARED);
+    EXPECT_TRUE(list->head->bitmap.test(3));
+    EXPECT_EQ(list->head->next, x);
+    EXPECT_EQ(get_blockers(list, x), std::vector<int>{ 1 });
+
+    EXPECT_FALSE(lock_acquire_fast(LT_TABLE, LT_PAGE, 5, 3, fast3));
+    EXPECT_TRUE(fast3.empty());
+
+    lock_release_fast(fast1[0], 1);
+    EXPECT_EQ(list->head, x);
+    EXPECT_TRUE(get_blockers(list, x).empty());
+
+    lock_release(x);
+    EXPECT_FALSE(list->fast_header.load() & FAST_HEADER_SLOW);
+    ASSERT_TRUE(lock_acquire_fast(LT_TABLE, LT_PAGE, 5, 3, fast3));
+    lock_release_fast(fast3[0], 3);
+    shutdown_lock_table();
+}
+
+// Idle entries are reclaimed when a partition runs out, and the new
+// generation tells a latch-free reader holding the old entry apart
+TEST(LockTable, ReclaimedEntryReuse) {
+    init_lock_table();
+    lock_table_partition_t* partition = get_partition(LT_TABLE, LT_PAGE);
+
+    std::vector<fast_lock_ref_t> fast;
+    ASSERT_TRUE(lock_acquire_fast(LT_TABLE, LT_PAGE, 0, 1, fast));
+    hash_table_entry_t* old = fast[0].entry;
+    uint64_t header = old->fast_header.load();
+    lock_release_fast(fast[0], 1);
+
+    // Fill the partition's first slab with idle entries of other pages,
+    // then one more entry makes it reclaim them all
+    int64_t page = LT_PAGE;
+    for (int i = 0; i < LOCK_SLAB_SIZE; i++) {
+        do page++; while (get_partition(LT_TABLE, page) != partition);
+        fast.clear();
+        ASSERT_TRUE(lock_acquire_fast(LT_TABLE, page, 0, 1, fast));
+        lock_release_fast(fast[0], 1);
+    }
+    EXPECT_EQ(partition->entry_slabs.size(), 1);
+    EXPECT_EQ(old->fast_header.load() >> 1, (header >> 1) + 1);
+    EXPECT_NE(old->fast_header.load(), header);
+
+    pthread_mutex_lock(&partition->latch);
+    EXPECT_EQ(find_entry(partition, LT_TABLE, LT_PAGE), nullptr);
+    pthread_mutex_unlock(&partition->latch);
+
+    fast.clear();
+    ASSERT_TRUE(lock_acquire_fast(LT_TABLE, LT_PAGE, 0, 1, fast));
+    EXPECT_EQ(fast[0].entry->page_id, LT_PAGE);
+    lock_release_fast(fast[0], 1);
+    shutdown_lock_table();
+}
+
+struct lt_waiter_t {
+    lock_t* lock;
+    std::atomic<bool> waiting;
+    std::atomic<bool> granted;
+};
+
+// Waits like trx_sleep, until no lock ahead conflicts
+void* lt_waiter(void* arg) {
+    lt_waiter_t* w = (lt_waiter_t*)arg;
+    pthread_mutex_t* latch = get_entry_latch(w->lock->sentinel);
+    pthread_mutex_lock(latch);
+    while (!get_blockers(w->lock->sentinel, w->lock).empty()) {
+        w->waiting = true;
+        pthread_cond_wait(&w->lock->lock_table_cond, latch);
+    }
+    w->granted = true;
+    pthread_mutex_unlock(latch);
+    return NULL;
+}
+
+// A record added to an S lock by compression conflicts with a later X
+// lock on it; releasing that S lock only wakes the X lock once no other
+// lock ahead of it conflicts
+TEST(LockTable, CompressedSharedConflict) {
+    init_lock_table();
+    lock_t* s1 = lock_acquire(LT_TABLE, LT_PAGE, 1, 1, LOCK_MODE_SHARED);
+    EXPECT_EQ(lock_acquire_compressed(LT_TABLE, LT_PAGE, 2, 1), s1);
+    EXPECT_TRUE(s1->bitmap.test(2));
+    lock_t* s3 = lock_acquire(LT_TABLE, LT_PAGE, 2, 3, LOCK_MODE_SHARED);
+    lock_t* x2 = lock_acquire(LT_TABLE, LT_PAGE, 2, 2, LOCK_MODE_EXCLUSIVE);
+
+    std::vector<int> blockers = get_blockers(x2->sentinel, x2);
+    std::sort(blockers.begin(), blockers.end());
+    EXPECT_EQ(blockers, (std::vector<int>{ 1, 3 }));
+    // No more records join an S lock once an X lock waits on them
+    EXPECT_EQ(lock_acquire_compressed(LT_TABLE, LT_PAGE, 2, 3), nullptr);
+    EXPECT_EQ(lock_acquire_compressed(LT_TABLE, LT_PAGE, 4, 3), s3);
+
+    lt_waiter_t w;
+    w.lock = x2;
+    w.waiting = false;
+    w.granted = false;
+    pthread_t waiter;
+    pthread_create(&waiter, NULL, lt_waiter, &w);
+    while (!w.waiting) usleep(1000);
+
+    lock_release(s1);
+    usleep(100000);
+    EXPECT_FALSE(w.granted);
+
+    lock_release(s3);
+    for (int i = 0; i < 5000 && !w.granted; i++) usleep(1000);
+    EXPECT_TRUE(w.granted);
+    if (!w.granted) {
+        pthread_mutex_lock(get_entry_latch(x2->sentinel));
+        pthread_cond_signal(&x2->lock_table_cond);
+        pthread_mutex_unlock(get_entry_latch(x2->sentinel));
+    }
+    pthread_join(waiter, NULL);
+    lock_release(x2);
+    shutdown_lock_table();
+}
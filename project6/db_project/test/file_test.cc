@@ -1,4 +1,5 @@
 #include "file.h"
+#include "compress.h"
 
 #include <gtest/gtest.h>
 
@@ -21,10 +22,36 @@ TEST(FileManager, FileInitializationTest)
 
     EXPECT_EQ(FileIO::size(fd), INITIAL_SIZE); // File size should equal to what it should be.
     EXPECT_EQ(PageIO::HeaderPage::get_num_pages(&header), INITIAL_FREE_PAGES + 1);
+    EXPECT_EQ(PageIO::HeaderPage::get_free_pagenum(&header), 0); // Free pages are not linked yet
+    EXPECT_EQ(PageIO::HeaderPage::get_high_water_mark(&header), 1);
+    EXPECT_EQ(PageIO::HeaderPage::get_page_size(&header), PAGE_SIZE);
 
     file_close_database_file();
 }
 
+// File created with a different page size is refused
+TEST(FileManager, PageSizeMismatch)
+{
+    std::remove("testps");
+    int64_t fd = file_open_table_file("testps");
+    page_t header;
+    file_read_page(fd, 0, &header);
+    PageIO::HeaderPage::set_page_size(&header, PAGE_SIZE * 2);
+    file_write_page(fd, 0, &header);
+    file_close_database_file();
+
+    EXPECT_EQ(file_open_table_file("testps"), -1);
+    file_close_database_file();
+}
+
+// Next page file_alloc_page() should hand out
+pagenum_t next_alloc_pagenum(page_t* header)
+{
+    pagenum_t free_pagenum = PageIO::HeaderPage::get_free_pagenum(header);
+    if (free_pagenum != 0) return free_pagenum;
+    return PageIO::HeaderPage::get_high_water_mark(header);
+}
+
 // Page Management - Simple Alloc/Free
 TEST(FileManager, SimpleAllocFree)
 {
@@ -33,17 +60,17 @@ TEST(FileManager, SimpleAllocFree)
     page_t header;
 
     file_read_page(fd, 0, &header);
-    pagenum_t firstnum = PageIO::HeaderPage::get_free_pagenum(&header);
+    pagenum_t firstnum = next_alloc_pagenum(&header);
     pagenum_t first = file_alloc_page(fd);
     EXPECT_EQ(first, firstnum);
 
     file_read_page(fd, 0, &header);
-    pagenum_t secondnum = PageIO::HeaderPage::get_free_pagenum(&header);
+    pagenum_t secondnum = next_alloc_pagenum(&header);
     pagenum_t second = file_alloc_page(fd);
     EXPECT_EQ(second, secondnum);
 
     file_read_page(fd, 0, &header);
-    EXPECT_NE(second, PageIO::HeaderPage::get_free_pagenum(&header));
+    EXPECT_NE(second, next_alloc_pagenum(&header));
 
     file_free_page(fd, first);
     file_read_page(fd, 0, &header);
@@ -115,3 +142,142 @@ TEST(FileManager, PageIO)
     file_free_page(fd, p);
     file_close_database_file();
 }
+
+
+// Tablespace - catalog page is created once and kept on reopen
+TEST(FileManager, TablespaceInitialization)
+{
+    std::remove("testts");
+    int64_t fd = file_open_tablespace_file("testts");
+    ASSERT_GE(fd, 0);
+
+    page_t header, catalog;
+    file_read_page(fd, 0, &header);
+    pagenum_t catalog_pagenum = PageIO::HeaderPage::get_catalog_pagenum(&header);
+    EXPECT_NE(catalog_pagenum, 0);
+    EXPECT_EQ(PageIO::HeaderPage::get_root_pagenum(&header), 0);
+
+    file_read_page(fd, catalog_pagenum, &catalog);
+    EXPECT_EQ(PageIO::CatalogPage::get_num_entries(&catalog), 0);
+    file_close_database_file();
+
+    fd = file_open_tablespace_file("testts");
+    file_read_page(fd, 0, &header);
+    EXPECT_EQ(PageIO::HeaderPage::get_catalog_pagenum(&header), catalog_pagenum);
+    file_close_database_file();
+
+    // A file that can't be opened is refused before its header is read
+    EXPECT_EQ(file_open_tablespace_file("no_such_dir/testts"), -1);
+}
+
+// Page checksum - detects a corrupted byte, unstamped pages always pass
+TEST(FileManager, PageChecksum)
+{
+    const char check[] = "123456789";
+    EXPECT_EQ(~crc32c(~0u, check, 9), 0xE3069283); // CRC32C check value
+
+    page_t page;
+    EXPECT_TRUE(PageIO::Checksum::verify(&page));
+
+    PageIO::BPT::set_num_keys(&page, 3);
+    page.set_data("Hello World!", 3000, 12);
+    PageIO::Checksum::stamp(&page);
+    EXPECT_NE(PageIO::Checksum::get(&page), 0);
+    EXPECT_TRUE(PageIO::Checksum::verify(&page));
+
+    page.set_data("J", 3000, 1);
+    EXPECT_FALSE(PageIO::Checksum::verify(&page));
+}
+
+// Page checksum - freeing and allocating a page without the header on
+// the buffer leaves a header that still verifies
+TEST(FileManager, ChecksumAfterUnbufferedFree)
+{
+    std::remove("testck");
+    int64_t fd = file_open_table_file("testck");
+    pagenum_t first = file_alloc_page(fd);
+    pagenum_t second = file_alloc_page(fd);
+
+    // Written back by the buffer, then evicted
+    page_t header;
+    file_read_page(fd, 0, &header);
+    PageIO::Checksum::stamp(&header);
+    file_write_page(fd, 0, &header);
+
+    file_free_page(fd, first);
+    file_read_page(fd, 0, &header);
+    EXPECT_TRUE(PageIO::Checksum::verify(&header));
+    EXPECT_EQ(PageIO::HeaderPage::get_free_pagenum(&header), first);
+
+    page_t page;
+    file_read_page(fd, first, &page);
+    EXPECT_TRUE(PageIO::Checksum::verify(&page));
+
+    file_free_page(fd, second);
+    EXPECT_EQ(file_alloc_page(fd), second);
+    file_read_page(fd, 0, &header);
+    EXPECT_TRUE(PageIO::Checksum::verify(&header));
+    EXPECT_EQ(PageIO::HeaderPage::get_free_pagenum(&header), first);
+    file_close_database_file();
+}
+
+// Compressed table - pages round-trip and take less space than raw pages
+TEST(FileManager, CompressedPageIO)
+{
+    char raw[PAGE_SIZE], packed[PAGE_SIZE], unpacked[PAGE_SIZE];
+    for (int i = 0; i < PAGE_SIZE; i++) raw[i] = "abcdefgh"[i % 8] + (i / 1000);
+    int packed_size = Compress::compress(raw, PAGE_SIZE, packed, PAGE_SIZE);
+    ASSERT_GT(packed_size, 0);
+    EXPECT_LT(packed_size, PAGE_SIZE / 8);
+    EXPECT_EQ(Compress::decompress(packed, packed_size, unpacked, PAGE_SIZE), PAGE_SIZE);
+    EXPECT_EQ(std::memcmp(raw, unpacked, PAGE_SIZE), 0);
+
+    std::remove("testcdb");
+    std::remove("testcdb.map");
+    int64_t fd = file_open_compressed_table_file("testcdb");
+    ASSERT_GE(fd, 0);
+
+    std::vector<pagenum_t> pages;
+    for (int i = 0; i < 100; i++)
+    {
+        pagenum_t p = file_alloc_page(fd);
+        raw[0] = i;
+        file_write_page(fd, p, raw);
+        pages.push_back(p);
+    }
+    file_close_database_file();
+
+    // Reopened through the normal path, the format is detected
+    fd = file_open_table_file("testcdb");
+    for (int i = 0; i < 100; i++)
+    {
+        file_read_page(fd, pages[i], unpacked);
+        raw[0] = i;
+        EXPECT_EQ(std::memcmp(raw, unpacked, PAGE_SIZE), 0);
+    }
+    EXPECT_LT(FileIO::size(fd), 100 * PAGE_SIZE / 4);
+    file_close_database_file();
+}
+
+// Compressed table - a rewritten page moves to a fresh extent, and the
+// old extents are reused once they are synced away from
+TEST(FileManager, CompressedRewrite)
+{
+    char raw[PAGE_SIZE], unpacked[PAGE_SIZE];
+    for (int i = 0; i < PAGE_SIZE; i++) raw[i] = "abcdefgh"[i % 8] + (i / 1000);
+
+    std::remove("testcdb2");
+    std::remove("testcdb2.map");
+    int64_t fd = file_open_compressed_table_file("testcdb2");
+    ASSERT_GE(fd, 0);
+    pagenum_t p = file_alloc_page(fd);
+    for (int i = 0; i < 1000; i++)
+    {
+        raw[0] = i;
+        file_write_page(fd, p, raw);
+    }
+    file_read_page(fd, p, unpacked);
+    EXPECT_EQ(std::memcmp(raw, unpacked, PAGE_SIZE), 0);
+    EXPECT_LT(FileIO::size(fd), 4 * COMPRESS_PENDING_FREE * COMPRESS_UNIT);
+    file_close_database_file();
+}
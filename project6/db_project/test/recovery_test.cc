@@ -3,9 +3,473 @@
 #include "mybpt.h"
 #include "trx.h"
 
+#include <algorithm>
+#include <dirent.h>
+#include <fcntl.h>
+#include <functional>
+#include <sys/wait.h>
+#include <unistd.h>
+
 #define BUF_SIZE 3
 
+// Crash tests: the work runs in a child process that stops without
+// shutdown_db, leaving the log and the table files as a crash would.
+// The parent then recovers and checks what survived.
+#define CRASH_N 2000
+
+static std::string crash_val(const char* tag, int i) {
+    return std::string(tag) + "-value-0123456789012345678901234567890123456789-" + std::to_string(i);
+}
+
+// Failures in the child are reported through its exit status
+static void child_check(bool ok) {
+    if (!ok) _exit(1);
+}
+
+static bool crash_after(const std::function<void()>& work) {
+    pid_t pid = fork();
+    if (pid == 0) {
+        work();
+        _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+static void crash_populate(char* pathname, char* log_path, char* logmsg_path) {
+    std::remove(pathname);
+    log_remove(log_path);
+    std::remove(logmsg_path);
+    ASSERT_EQ(init_db(50, 0, 0, log_path, logmsg_path), 0);
+    int table_id = open_table(pathname);
+    for (int i = 1; i <= CRASH_N; i++) {
+        std::string data = crash_val("init", i);
+        ASSERT_EQ(db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length()), 0);
+    }
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// Commits updates to keys 1..1000, then leaves a loser over every third
+// key and crashes. The commit of an empty trx makes the loser's records
+// durable, so recovery has to roll them back.
+static void crash_with_loser(int num_buf, char* pathname, char* log_path, char* logmsg_path) {
+    crash_populate(pathname, log_path, logmsg_path);
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(init_db(num_buf, 0, 0, log_path, logmsg_path) == 0);
+        int table_id = open_table(pathname);
+        uint16_t old_val_size;
+        for (int t = 0; t < 20; t++) {
+            int trx_id = trx_begin();
+            for (int i = t * 50 + 1; i <= t * 50 + 50; i++) {
+                std::string data = crash_val("comt", i);
+                child_check(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id) == 0);
+            }
+            trx_commit(trx_id);
+        }
+        int loser = trx_begin();
+        for (int i = 1; i <= 1500; i += 3) {
+            std::string data = crash_val("losr", i);
+            child_check(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, loser) == 0);
+        }
+        trx_commit(trx_begin());
+    }));
+}
+
+static int crash_check_committed(int64_t table_id) {
+    int bad = 0;
+    for (int i = 1; i <= CRASH_N; i++) {
+        char ret_val[MAX_VAL_SIZE];
+        uint16_t val_size;
+        if (db_find(table_id, i, ret_val, &val_size) != 0 ||
+            std::string(ret_val, val_size) != crash_val(i <= 1000 ? "comt" : "init", i)) {
+            bad++;
+        }
+    }
+    return bad;
+}
+
+// Committed updates survive, the loser's are undone
+TEST(RecoveryTest, CommittedAndLoserUpdates) {
+    crash_with_loser(50, (char*)"DATA71", (char*)"rlog71", (char*)"rlogmsg71");
+
+    ASSERT_EQ(init_db(50, 0, 0, (char*)"rlog71", (char*)"rlogmsg71"), 0);
+    int table_id = open_table((char*)"DATA71");
+    EXPECT_EQ(crash_check_committed(table_id), 0);
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// The pool is too small to hold the updated pages, so the loser's
+// changes reach the table file before the crash and the committed
+// ones have to be redone
+TEST(RecoveryTest, CrashWithEvictions) {
+    crash_with_loser(BUF_SIZE, (char*)"DATA72", (char*)"rlog72", (char*)"rlogmsg72");
+
+    ASSERT_EQ(init_db(BUF_SIZE, 0, 0, (char*)"rlog72", (char*)"rlogmsg72"), 0);
+    int table_id = open_table((char*)"DATA72");
+    EXPECT_EQ(crash_check_committed(table_id), 0);
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// Recovery crashes after undoing part of the losers' updates (flag 2),
+// and the next recovery finishes the job from the CLRs
+TEST(RecoveryTest, CrashDuringUndo) {
+    char* pathname = (char*)"DATA73";
+    char* log_path = (char*)"rlog73";
+    char* logmsg_path = (char*)"rlogmsg73";
+    crash_populate(pathname, log_path, logmsg_path);
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(init_db(20, 0, 0, log_path, logmsg_path) == 0);
+        int table_id = open_table(pathname);
+        uint16_t old_val_size;
+        int losers[8];
+        for (int l = 0; l < 8; l++) losers[l] = trx_begin();
+        for (int i = 1; i <= CRASH_N; i++) {
+            std::string data = crash_val("losr", i);
+            int trx_id = i % 3 == 0 ? trx_begin() : losers[i % 8];
+            if (i % 3 == 0) data = crash_val("comt", i);
+            child_check(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id) == 0);
+            if (i % 3 == 0) trx_commit(trx_id);
+        }
+        trx_commit(trx_begin());
+    }));
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(init_db(20, 2, 300, log_path, logmsg_path) == 0);
+    }));
+
+    ASSERT_EQ(init_db(20, 0, 0, log_path, logmsg_path), 0);
+    int table_id = open_table(pathname);
+    int bad = 0;
+    for (int i = 1; i <= CRASH_N; i++) {
+        char ret_val[MAX_VAL_SIZE];
+        uint16_t val_size;
+        if (db_find(table_id, i, ret_val, &val_size) != 0 ||
+            std::string(ret_val, val_size) != crash_val(i % 3 == 0 ? "comt" : "init", i)) {
+            bad++;
+        }
+    }
+    EXPECT_EQ(bad, 0);
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// New transactions run while the losers are rolled back in the background
+TEST(RecoveryTest, InstantRestart) {
+    char* pathname = (char*)"DATA74";
+    char* log_path = (char*)"rlog74";
+    char* logmsg_path = (char*)"rlogmsg74";
+    crash_with_loser(50, pathname, log_path, logmsg_path);
+
+    ASSERT_EQ(init_db(50, RECOVER_INSTANT, 0, log_path, logmsg_path), 0);
+    int table_id = open_table(pathname);
+    int trx_id = trx_begin();
+    char ret_val[MAX_VAL_SIZE];
+    uint16_t val_size, old_val_size;
+    // Waits for the loser's rollback if it has not reached the key yet
+    for (int i = 1; i <= 1500; i += 3) {
+        ASSERT_EQ(db_find(table_id, i, ret_val, &val_size, trx_id), 0);
+        EXPECT_EQ(std::string(ret_val, val_size), crash_val(i <= 1000 ? "comt" : "init", i));
+    }
+    std::string data = crash_val("newt", 1);
+    ASSERT_EQ(db_update(table_id, 1, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id), 0);
+    trx_commit(trx_id);
+    EXPECT_EQ(shutdown_db(), 0);
+
+    ASSERT_EQ(init_db(50, 0, 0, log_path, logmsg_path), 0);
+    table_id = open_table(pathname);
+    ASSERT_EQ(db_find(table_id, 1, ret_val, &val_size), 0);
+    EXPECT_EQ(std::string(ret_val, val_size), data);
+    for (int i = 2; i <= CRASH_N; i++) {
+        ASSERT_EQ(db_find(table_id, i, ret_val, &val_size), 0);
+        EXPECT_EQ(std::string(ret_val, val_size), crash_val(i <= 1000 ? "comt" : "init", i));
+    }
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// Inserts, then deletes of every third key in the first half, crashed
+// without waiting for the log. Splits and merges are logged whole, so
+// the recovered tree holds some prefix of the operations, at least up
+// to the half of the deletes made durable by a commit.
+TEST(RecoveryTest, InsertDeleteCrash) {
+    char* pathname = (char*)"DATA75";
+    char* log_path = (char*)"rlog75";
+    char* logmsg_path = (char*)"rlogmsg75";
+    int n = 10000;
+    std::remove(pathname);
+    log_remove(log_path);
+    std::remove(logmsg_path);
+    std::vector<int> deletes;
+    for (int i = 3; i <= n / 2; i += 3) deletes.push_back(i);
+
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(init_db(8, 0, 0, log_path, logmsg_path) == 0);
+        int table_id = open_table(pathname);
+        for (int i = 1; i <= n; i++) {
+            std::string data = crash_val("init", i);
+            child_check(db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length()) == 0);
+        }
+        for (size_t d = 0; d < deletes.size(); d++) {
+            if (d == deletes.size() / 2) trx_commit(trx_begin());
+            child_check(db_delete(table_id, deletes[d]) == 0);
+        }
+    }));
+
+    ASSERT_EQ(init_db(8, 0, 0, log_path, logmsg_path), 0);
+    int table_id = open_table(pathname);
+    std::vector<bool> present(n + 1);
+    char ret_val[MAX_VAL_SIZE];
+    uint16_t val_size;
+    for (int i = 1; i <= n; i++) {
+        present[i] = db_find(table_id, i, ret_val, &val_size) == 0;
+        if (present[i]) EXPECT_EQ(std::string(ret_val, val_size), crash_val("init", i));
+    }
+    size_t deleted = 0;
+    while (deleted < deletes.size() && !present[deletes[deleted]]) deleted++;
+    EXPECT_GE(deleted, deletes.size() / 2);
+    std::vector<bool> expected(n + 1, true);
+    for (size_t d = 0; d < deleted; d++) expected[deletes[d]] = false;
+    for (int i = 1; i <= n; i++) EXPECT_EQ(present[i], expected[i]) << "key " << i;
+
+    // The tree keeps working
+    for (int i = 1; i <= n; i++) {
+        if (present[i]) continue;
+        std::string data = crash_val("init", i);
+        ASSERT_EQ(db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length()), 0);
+    }
+    for (int i = 1; i <= n; i++) ASSERT_EQ(db_find(table_id, i, ret_val, &val_size), 0);
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// A loser updates the even keys, then inserts of the odd keys shift their
+// slots and split their leaves. Undo has to find the updated records by
+// key, not at the slots they had.
+TEST(RecoveryTest, LoserThenInserts) {
+    char* pathname = (char*)"DATA80";
+    char* log_path = (char*)"rlog80";
+    char* logmsg_path = (char*)"rlogmsg80";
+    int n = 1000;
+    std::remove(pathname);
+    log_remove(log_path);
+    std::remove(logmsg_path);
+
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(init_db(20, 0, 0, log_path, logmsg_path) == 0);
+        int table_id = open_table(pathname);
+        for (int i = 2; i <= n; i += 2) {
+            std::string data = crash_val("init", i);
+            child_check(db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length()) == 0);
+        }
+        uint16_t old_val_size;
+        int loser = trx_begin();
+        for (int i = 2; i <= n; i += 2) {
+            std::string data = crash_val("losr", i);
+            child_check(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, loser) == 0);
+        }
+        for (int i = 1; i <= n; i += 2) {
+            std::string data = crash_val("init", i);
+            child_check(db_insert(table_id, i, const_cast<char*>(data.c_str()), data.length()) == 0);
+        }
+        trx_commit(trx_begin());
+    }));
+
+    ASSERT_EQ(init_db(20, 0, 0, log_path, logmsg_path), 0);
+    int table_id = open_table(pathname);
+    char ret_val[MAX_VAL_SIZE];
+    uint16_t val_size;
+    for (int i = 1; i <= n; i++) {
+        ASSERT_EQ(db_find(table_id, i, ret_val, &val_size), 0) << "key " << i;
+        EXPECT_EQ(std::string(ret_val, val_size), crash_val("init", i)) << "key " << i;
+    }
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// Tables of a tablespace share its header and catalog pages. Table 1
+// frees its only page and table 2 takes it, so every page table 1 changed
+// was last read for table 2 when the checkpoint saves the dirty page
+// table. Redo still has to find them dirty, or table 1 gets its root back.
+TEST(RecoveryTest, TablespaceCheckpointCrash) {
+    char* tablespace = (char*)"TS78";
+    char* log_path = (char*)"rlog78";
+    char* logmsg_path = (char*)"rlogmsg78";
+    std::remove(tablespace);
+    log_remove(log_path);
+    std::remove(logmsg_path);
+
+    ASSERT_EQ(init_db(1000, 0, 0, log_path, logmsg_path), 0);
+    int64_t ts = open_tablespace(tablespace);
+    ASSERT_GE(ts, 0);
+    ASSERT_EQ(open_table_in_tablespace(ts, (char*)"DATA781"), 781);
+    ASSERT_EQ(open_table_in_tablespace(ts, (char*)"DATA782"), 782);
+    std::string data = crash_val("init", 1);
+    ASSERT_EQ(db_insert(781, 1, const_cast<char*>(data.c_str()), data.length()), 0);
+    for (int i = 1; i <= 40; i++) {
+        data = crash_val("init", i);
+        ASSERT_EQ(db_insert(782, i, const_cast<char*>(data.c_str()), data.length()), 0);
+    }
+    EXPECT_EQ(shutdown_db(), 0);
+
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(open_tablespace(tablespace) >= 0);
+        child_check(init_db(1000, 0, 0, log_path, logmsg_path) == 0);
+        child_check(db_delete(781, 1) == 0);
+        for (int i = 41; i <= 400; i++) {
+            std::string data = crash_val("init", i);
+            child_check(db_insert(782, i, const_cast<char*>(data.c_str()), data.length()) == 0);
+        }
+        log_checkpoint();
+    }));
+
+    ASSERT_GE(open_tablespace(tablespace), 0);
+    ASSERT_EQ(init_db(1000, 0, 0, log_path, logmsg_path), 0);
+    EXPECT_EQ(buf_get_root_pagenum(781), 0);
+    for (int i = 1; i <= 400; i++) {
+        char ret_val[112];
+        uint16_t val_size;
+        EXPECT_NE(db_find(781, i, ret_val, &val_size), 0) << "key " << i;
+        ASSERT_EQ(db_find(782, i, ret_val, &val_size), 0) << "key " << i;
+        EXPECT_EQ(std::string(ret_val, val_size), crash_val("init", i));
+    }
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// Numbers n of the segment files <log_path>.<n>, in order
+static std::vector<uint64_t> log_segment_numbers(const char* log_path) {
+    std::vector<uint64_t> numbers;
+    std::string prefix = std::string(log_path) + ".";
+    DIR* dir = opendir(".");
+    if (dir == nullptr) return numbers;
+    while (dirent* entry = readdir(dir)) {
+        std::string name = entry->d_name;
+        if (name.compare(0, prefix.size(), prefix) != 0 || name.size() == prefix.size()) continue;
+        std::string number = name.substr(prefix.size());
+        if (number.find_first_not_of("0123456789") != std::string::npos) continue;
+        numbers.push_back(std::stoull(number));
+    }
+    closedir(dir);
+    std::sort(numbers.begin(), numbers.end());
+    return numbers;
+}
+
+#define SEGMENT_KEYS 200
+#define SEGMENT_ROUNDS 400
+
+// The log runs over many segments with a checkpoint after every round of
+// updates. Old segments are renamed to follow the last one or deleted, and
+// the crash leaves the log end in a renamed segment that still holds older
+// records after it. Only small segments make this quick, see
+// db_test_log_segments.
+TEST(RecoveryTest, SegmentRecycling) {
+    if (LOG_SEGMENT_SIZE > (1 << 20) || LOG_COMPRESS) GTEST_SKIP() << "needs small uncompressed log segments";
+    char* pathname = (char*)"DATA79";
+    char* log_path = (char*)"rlog79";
+    char* logmsg_path = (char*)"rlogmsg79";
+    crash_populate(pathname, log_path, logmsg_path);
+
+    ASSERT_TRUE(crash_after([&]() {
+        child_check(init_db(50, 0, 0, log_path, logmsg_path) == 0);
+        int table_id = open_table(pathname);
+        uint16_t old_val_size;
+        for (int r = 1; r <= SEGMENT_ROUNDS; r++) {
+            int trx_id = trx_begin();
+            for (int i = 1; i <= SEGMENT_KEYS; i++) {
+                std::string data = crash_val(("r" + std::to_string(r)).c_str(), i);
+                child_check(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id) == 0);
+            }
+            trx_commit(trx_id);
+            log_checkpoint();
+            // Segments in use, the next one and the spares
+            child_check(log_segment_numbers(log_path).size() <= LOG_SPARE_SEGMENTS + 3);
+        }
+        int loser = trx_begin();
+        for (int i = 1; i <= SEGMENT_KEYS; i += 2) {
+            std::string data = crash_val("losr", i);
+            child_check(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, loser) == 0);
+        }
+        trx_commit(trx_begin());
+
+        uint64_t end = log_next_lsn();
+        std::vector<uint64_t> segments = log_segment_numbers(log_path);
+        child_check(end > 8 * LOG_SEGMENT_SIZE);
+        child_check(segments.front() > 0 && segments.back() > end / LOG_SEGMENT_SIZE + 1);
+
+        // The block after the end still holds a record of an earlier use
+        uint64_t next_block = end - end % LOG_BLOCK_SIZE + LOG_BLOCK_SIZE;
+        child_check(next_block % LOG_SEGMENT_SIZE != 0);
+        std::string segment = std::string(log_path) + "." + std::to_string(end / LOG_SEGMENT_SIZE);
+        int fd = open(segment.c_str(), O_RDONLY);
+        char stale[LOG_ENTRY_SIZE];
+        child_check(pread(fd, stale, sizeof(stale), next_block % LOG_SEGMENT_SIZE) == sizeof(stale));
+        close(fd);
+        child_check(std::any_of(stale, stale + sizeof(stale), [](char c) { return c != 0; }));
+    }));
+
+    for (int restart = 0; restart < 2; restart++) {
+        ASSERT_EQ(init_db(50, 0, 0, log_path, logmsg_path), 0);
+        int table_id = open_table(pathname);
+        EXPECT_GT(log_next_lsn(), 8 * LOG_SEGMENT_SIZE);
+        for (int i = 1; i <= CRASH_N; i++) {
+            char ret_val[MAX_VAL_SIZE];
+            uint16_t val_size;
+            std::string tag = i > SEGMENT_KEYS ? "init" : restart == 0 ? "r" + std::to_string(SEGMENT_ROUNDS) : "next";
+            std::string expected = crash_val(tag.c_str(), i);
+            ASSERT_EQ(db_find(table_id, i, ret_val, &val_size), 0) << "key " << i;
+            EXPECT_EQ(std::string(ret_val, val_size), expected) << "key " << i;
+        }
+        // Appended after the end recovery found, read by the next restart
+        int trx_id = trx_begin();
+        uint16_t old_val_size;
+        for (int i = 1; i <= SEGMENT_KEYS; i++) {
+            std::string data = crash_val("next", i);
+            ASSERT_EQ(db_update(table_id, i, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id), 0);
+        }
+        trx_commit(trx_id);
+        EXPECT_EQ(shutdown_db(), 0);
+    }
+}
+
+// Every page but the header fails its checksum. Reads report an error
+// instead of stopping the process, and recovery skips the pages.
+TEST(RecoveryTest, CorruptedPages) {
+    char* pathname = (char*)"DATA76";
+    char* log_path = (char*)"rlog76";
+    char* logmsg_path = (char*)"rlogmsg76";
+    crash_populate(pathname, log_path, logmsg_path);
+
+    FILE* fp = fopen(pathname, "r+b");
+    ASSERT_NE(fp, nullptr);
+    fseek(fp, 0, SEEK_END);
+    long size = ftell(fp);
+    for (long offset = PAGE_SIZE + 200; offset < size; offset += PAGE_SIZE) {
+        fseek(fp, offset, SEEK_SET);
+        int c = fgetc(fp);
+        fseek(fp, offset, SEEK_SET);
+        fputc(c ^ 0xff, fp);
+    }
+    fclose(fp);
+
+    ASSERT_EQ(init_db(50, 0, 0, log_path, logmsg_path), 0);
+    int table_id = open_table(pathname);
+    char ret_val[112];
+    uint16_t val_size;
+    EXPECT_NE(db_find(table_id, 1, ret_val, &val_size), 0);
+    std::string data = crash_val("next", 1);
+    EXPECT_NE(db_insert(table_id, CRASH_N + 1, const_cast<char*>(data.c_str()), data.length()), 0);
+    int trx_id = trx_begin();
+    uint16_t old_val_size;
+    EXPECT_NE(db_update(table_id, 1, const_cast<char*>(data.c_str()), data.length(), &old_val_size, trx_id), 0);
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
+// A log that can't be opened fails init_db, and the next init_db works
+TEST(RecoveryTest, LogOpenFailure) {
+    EXPECT_NE(init_db(50, 0, 0, (char*)"no_such_dir/rlog77", (char*)"rlogmsg77"), 0);
+    log_remove((char*)"rlog77");
+    ASSERT_EQ(init_db(50, 0, 0, (char*)"rlog77", (char*)"rlogmsg77"), 0);
+    EXPECT_EQ(shutdown_db(), 0);
+}
+
 TEST(RecoveryTest, LogCreationTest){
+    std::remove("DATA1");
+    log_remove((char*)"logfile.data");
     EXPECT_EQ(init_db(BUF_SIZE, 0, 0, "logfile.data", "logmsg.txt"), 0);
 
     std::cout << "[DEBUG] open table" << std::endl;